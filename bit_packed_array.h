@@ -0,0 +1,492 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <emu_c_utils/emu_c_utils.h>
+#include <cilk/cilk.h>
+
+#include "replicated.h"
+#include "execution_policy.h"
+#include "block_array.h"
+
+namespace emu {
+
+namespace detail {
+
+// Shifts that return zero instead of being undefined for shift >= 64
+inline unsigned long
+shift_left(unsigned long x, long shift) { return shift < 64 ? x << shift : 0; }
+inline unsigned long
+shift_right(unsigned long x, long shift) { return shift < 64 ? x >> shift : 0; }
+
+// Reads consecutive bit_width-bit values from an array of words, loading each
+// word exactly once
+class bit_reader
+{
+private:
+    const unsigned long* next_;
+    unsigned long buffer_;
+    // Number of unread bits in buffer_
+    long avail_;
+    long width_;
+    unsigned long mask_;
+public:
+    bit_reader(const unsigned long* words, long width)
+    : next_(words), buffer_(0), avail_(0), width_(width)
+    , mask_(shift_left(1UL, width) - 1) {}
+
+    unsigned long
+    read()
+    {
+        if (avail_ >= width_) {
+            unsigned long value = buffer_ & mask_;
+            buffer_ = shift_right(buffer_, width_);
+            avail_ -= width_;
+            return value;
+        }
+        // Value straddles the word boundary: take the rest from the next word
+        unsigned long word = *next_++;
+        unsigned long value = (buffer_ | shift_left(word, avail_)) & mask_;
+        buffer_ = shift_right(word, width_ - avail_);
+        avail_ += 64 - width_;
+        return value;
+    }
+};
+
+// Writes consecutive bit_width-bit values to an array of words, storing each
+// word exactly once
+class bit_writer
+{
+private:
+    unsigned long* next_;
+    unsigned long buffer_;
+    // Number of filled bits in buffer_
+    long used_;
+    long width_;
+public:
+    bit_writer(unsigned long* words, long width)
+    : next_(words), buffer_(0), used_(0), width_(width) {}
+
+    void
+    write(unsigned long value)
+    {
+        buffer_ |= shift_left(value, used_);
+        used_ += width_;
+        if (used_ >= 64) {
+            *next_++ = buffer_;
+            used_ -= 64;
+            buffer_ = shift_right(value, width_ - used_);
+        }
+    }
+
+    // Stores the last partial word
+    void
+    flush()
+    {
+        if (used_ > 0) { *next_ = buffer_; }
+    }
+};
+
+} // end namespace detail
+
+/**
+ * Distributed array of unsigned integers, each stored in a fixed number of
+ * bits chosen at run time (1 to 64). For example, vertex IDs in a graph with
+ * fewer than 2^34 vertices need only 34 bits each.
+ *
+ * Elements are grouped into blocks of 4096, which fill exactly 64 * width
+ * words with no padding between elements. Blocks are dealt out to the
+ * nodelets round-robin (using a block_array), so a value that straddles two
+ * words is still on a single nodelet.
+ *
+ * Random access decodes one element. Bulk access (pack, unpack, for_each and
+ * reduce) runs a task on the nodelet that owns each block and streams through
+ * its words, loading or storing each word once.
+ */
+class bit_packed_array
+{
+public:
+    // Number of elements in each block
+    static constexpr long block_elements = 4096;
+
+private:
+    repl<long> n_;
+    repl<long> width_;
+    block_array<unsigned long> words_;
+
+    static long
+    num_blocks(long n) { return (n + block_elements - 1) / block_elements; }
+
+    // Number of words in each block
+    static long
+    block_words(long width) { return block_elements / 64 * width; }
+
+public:
+    // Default constructor
+    bit_packed_array() : n_(0), width_(0) {}
+
+    /**
+     * Constructs a bit_packed_array. Elements are left uninitialized.
+     * @param n Number of elements
+     * @param width Number of bits per element, from 1 to 64
+     */
+    bit_packed_array(long n, long width)
+    : n_(n)
+    , width_(width)
+    , words_(std::max(num_blocks(n), 1L) * block_words(width),
+        block_words(width))
+    {
+        assert(width >= 1 && width <= 64);
+    }
+
+    friend void
+    swap(bit_packed_array& first, bit_packed_array& second)
+    {
+        using std::swap;
+        swap(first.n_, second.n_);
+        swap(first.width_, second.width_);
+        swap(first.words_, second.words_);
+    }
+
+    // Copy constructor
+    bit_packed_array(const bit_packed_array & other) = delete;
+
+    // Assignment operator (using copy-and-swap idiom)
+    bit_packed_array& operator= (bit_packed_array other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+
+    // Move constructor (using copy-and-swap idiom)
+    bit_packed_array(bit_packed_array&& other) noexcept : bit_packed_array()
+    {
+        swap(*this, other);
+    }
+
+    // Returns the number of bits needed to store values up to max_value
+    static long
+    required_width(unsigned long max_value)
+    {
+        long width = 1;
+        while (width < 64 && (max_value >> width) != 0) { ++width; }
+        return width;
+    }
+
+    long size() const { return n_; }
+    long width() const { return width_; }
+    long num_blocks() const { return num_blocks(n_); }
+    // Largest value that fits in an element
+    unsigned long max_value() const { return detail::shift_left(1UL, width_) - 1; }
+
+    // Number of elements in block b
+    long block_size(long b) const
+    {
+        return std::min(block_elements, n_ - b * block_elements);
+    }
+
+    // Returns a pointer to the first word of block b
+    unsigned long* block(long b) { return words_.block(b); }
+    const unsigned long* block(long b) const
+    {
+        return const_cast<block_array<unsigned long>&>(words_).block(b);
+    }
+
+    // Underlying storage, one block of words per block of elements
+    block_array<unsigned long>& storage() { return words_; }
+
+    unsigned long
+    get(long i) const
+    {
+        const unsigned long* words = block(i / block_elements);
+        long bit = (i % block_elements) * width_;
+        long offset = bit % 64;
+        unsigned long value = words[bit / 64] >> offset;
+        if (offset + width_ > 64) {
+            value |= words[bit / 64 + 1] << (64 - offset);
+        }
+        return value & max_value();
+    }
+
+    /**
+     * Sets element i to value. Modifies the word(s) that hold the element
+     * without atomics, so this is not safe alongside concurrent writes to
+     * neighboring elements. Use pack() to fill the array in parallel.
+     */
+    void
+    set(long i, unsigned long value)
+    {
+        assert(value <= max_value());
+        unsigned long* words = block(i / block_elements);
+        long bit = (i % block_elements) * width_;
+        long offset = bit % 64;
+        unsigned long mask = max_value();
+        unsigned long& lo = words[bit / 64];
+        lo = (lo & ~(mask << offset)) | (value << offset);
+        if (offset + width_ > 64) {
+            unsigned long& hi = words[bit / 64 + 1];
+            long shift = 64 - offset;
+            hi = (hi & ~(mask >> shift)) | (value >> shift);
+        }
+    }
+
+    unsigned long operator[] (long i) const { return get(i); }
+};
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+/**
+ * Copyable handle on the blocks of a bit_packed_array. Tasks capture this
+ * instead of a pointer to the array, so they don't migrate back to the array
+ * object to find their block.
+ */
+class packed_blocks
+{
+private:
+    block_iterator<unsigned long> words_;
+    long n_;
+    long width_;
+public:
+    explicit packed_blocks(const bit_packed_array& array)
+    : words_(const_cast<bit_packed_array&>(array).storage().begin())
+    , n_(array.size())
+    , width_(array.width())
+    {}
+
+    long width() const { return width_; }
+    long first(long b) const { return b * bit_packed_array::block_elements; }
+    long last(long b) const
+    {
+        return std::min(n_, first(b) + bit_packed_array::block_elements);
+    }
+    unsigned long* block(long b) const
+    {
+        return (words_ + b * words_.block_size()).ptr();
+    }
+};
+
+// Calls worker(i, value) for each element of block b, in order
+template<class Function>
+void
+unpack_block(packed_blocks blocks, long b, Function worker)
+{
+    emu::detail::bit_reader reader(blocks.block(b), blocks.width());
+    for (long i = blocks.first(b); i < blocks.last(b); ++i) {
+        worker(i, reader.read());
+    }
+}
+
+template<class T, class BinaryOp>
+reduce_partial<T>
+reduce_packed_blocks(packed_blocks blocks, long b, long num_blocks,
+    T init, BinaryOp binary_op);
+
+// Reduces a subtree of blocks in a spawned thread
+// The thread counts against the thread budget of its nodelet while it runs
+template<class T, class BinaryOp>
+reduce_partial<T>
+reduce_packed_subtree(packed_blocks blocks, long b, long num_blocks,
+    T init, BinaryOp binary_op)
+{
+    thread_budget_guard guard;
+    return reduce_packed_blocks(blocks, b, num_blocks, init, binary_op);
+}
+
+/**
+ * Reduces num_blocks blocks, starting with block b and stepping by
+ * nodelets() (i.e. the blocks on one nodelet), with a binary tree of spawns.
+ * Partial sums live in the stack frames of the tree. Each block starts from
+ * its first value, so init is only a placeholder and is not folded in.
+ */
+template<class T, class BinaryOp>
+reduce_partial<T>
+reduce_packed_blocks(packed_blocks blocks, long b, long num_blocks,
+    T init, BinaryOp binary_op)
+{
+    if (num_blocks == 1) {
+        reduce_partial<T> sum{init, false};
+        unpack_block(blocks, b, [&](long, unsigned long value) {
+            sum.value = sum.valid ? binary_op(sum.value, value) : T(value);
+            sum.valid = true;
+        });
+        return sum;
+    }
+    long half = num_blocks / 2;
+    reduce_partial<T> left = cilk_spawn reduce_packed_subtree(
+        blocks, b, half, init, binary_op);
+    reduce_partial<T> right = reduce_packed_blocks(blocks,
+        b + half * nodelets(), num_blocks - half, init, binary_op);
+    cilk_sync;
+    return combine_partials(left, right, binary_op);
+}
+
+/**
+ * Calls f(b) for each block b of the array, on the nodelet that owns it.
+ * Each block is a separate task of 4096 elements, so the grain size of the
+ * policy is ignored.
+ */
+template<class Policy, class Function>
+void
+for_each_packed_block(Policy policy, const bit_packed_array& array, Function f)
+{
+    auto& storage = const_cast<bit_packed_array&>(array).storage();
+    for_each_block(policy, storage, array.num_blocks(), f);
+}
+
+} // end namespace detail
+
+/**
+ * Packs the values in [first, last) into array, which must have the same size.
+ * Each block is encoded by a task on the nodelet that owns it.
+ */
+template<class ExecutionPolicy, class InputIt,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+pack(ExecutionPolicy policy, InputIt first, InputIt last,
+    bit_packed_array& array)
+{
+    assert(std::distance(first, last) == array.size());
+    detail::packed_blocks blocks(array);
+    unsigned long max_value = array.max_value();
+    detail::for_each_packed_block(policy, array, [=](long b) {
+        emu::detail::bit_writer writer(blocks.block(b), blocks.width());
+        for (long i = blocks.first(b); i < blocks.last(b); ++i) {
+            unsigned long value = first[i];
+            assert(value <= max_value);
+            // Mask so an oversized value can't spill into its neighbors
+            writer.write(value & max_value);
+        }
+        writer.flush();
+    });
+}
+
+// Decodes every element of array into out
+template<class ExecutionPolicy, class OutputIt,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+unpack(ExecutionPolicy policy, const bit_packed_array& array, OutputIt out)
+{
+    detail::packed_blocks blocks(array);
+    detail::for_each_packed_block(policy, array, [=](long b) {
+        detail::unpack_block(blocks, b, [=](long i, unsigned long value) {
+            out[i] = value;
+        });
+    });
+}
+
+/**
+ * Calls worker(value) for each element of array. Elements within a block are
+ * visited in order, by a task on the block's nodelet.
+ */
+template<class ExecutionPolicy, class UnaryFunction,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+for_each(ExecutionPolicy policy, const bit_packed_array& array,
+    UnaryFunction worker)
+{
+    detail::packed_blocks blocks(array);
+    detail::for_each_packed_block(policy, array, [=](long b) {
+        detail::unpack_block(blocks, b, [&](long, unsigned long value) {
+            worker(value);
+        });
+    });
+}
+
+/**
+ * Reduces the elements of array. Each nodelet reduces its own blocks into a
+ * replicated partial sum, then the partial sums are combined.
+ */
+template<class ExecutionPolicy, class T = unsigned long,
+    class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+T
+reduce(ExecutionPolicy policy, const bit_packed_array& array,
+    T init = T{}, BinaryOp binary_op = std::plus<>())
+{
+    detail::packed_blocks blocks(array);
+    long num_blocks = array.num_blocks();
+    if (num_blocks == 0) {
+        return init;
+    } else if constexpr (std::is_same_v<ExecutionPolicy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        return visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            return reduce(policy, array, init, binary_op);
+        });
+    } else if constexpr (std::is_same_v<
+        remove_parallel_t<ExecutionPolicy>, ExecutionPolicy>) {
+        // Visit the blocks in order
+        for (long b = 0; b < num_blocks; ++b) {
+            detail::unpack_block(blocks, b, [&](long, unsigned long value) {
+                init = binary_op(init, value);
+            });
+        }
+        return init;
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        return reduce(remove_parallel_t<ExecutionPolicy>(),
+            array, init, binary_op);
+    } else {
+        // Allocate a partial sum on each nodelet
+        // Nodelets that hold no blocks contribute nothing
+        auto partials = emu::make_repl<detail::reduce_partial<T>>(
+            detail::reduce_partial<T>{init, false});
+        repl<detail::reduce_partial<T>>* partials_ptr = partials.get();
+        auto& storage = const_cast<bit_packed_array&>(array).storage();
+        auto begin = storage.begin();
+        auto end = begin + num_blocks * storage.block_size();
+        detail::block_spawn(policy, 0, nodelets(), begin, end, [=](long nlet) {
+            // Block b is on nodelet b % nodelets()
+            long count = (num_blocks - nlet + nodelets() - 1) / nodelets();
+            partials_ptr->get_nth(nlet) = detail::reduce_packed_blocks(
+                blocks, nlet, count, init, binary_op);
+        });
+        // Reduce across the partial sums, then fold in init once
+        return detail::fold_init(init, repl_reduce(*partials,
+            [=](const auto& lhs, const auto& rhs) {
+                return detail::combine_partials(lhs, rhs, binary_op);
+            }), binary_op);
+    }
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class InputIt>
+void
+pack(InputIt first, InputIt last, bit_packed_array& array)
+{
+    pack(emu::default_policy, first, last, array);
+}
+
+template<class OutputIt>
+void
+unpack(const bit_packed_array& array, OutputIt out)
+{
+    unpack(emu::default_policy, array, out);
+}
+
+template<class UnaryFunction>
+void
+for_each(const bit_packed_array& array, UnaryFunction worker)
+{
+    for_each(emu::default_policy, array, worker);
+}
+
+template<class T = unsigned long, class BinaryOp = std::plus<>>
+T
+reduce(const bit_packed_array& array,
+    T init = T{}, BinaryOp binary_op = std::plus<>())
+{
+    return reduce(emu::default_policy, array, init, binary_op);
+}
+
+} // end namespace emu::parallel
@@ -0,0 +1,676 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <emu_c_utils/emu_c_utils.h>
+#include <cilk/cilk.h>
+
+#include "replicated.h"
+#include "out_of_memory.h"
+#include "nodelets.h"
+#include "execution_policy.h"
+#include "for_each.h"
+#include "reduce.h"
+
+namespace emu {
+
+/**
+ * Iterator over a block-cyclic array. Element i is in block (i / B), and
+ * block b is stored on nodelet (b % nodelets()) at local block (b / nodelets()).
+ *
+ * Caches a raw pointer to the current element, so incrementing within a block
+ * is as cheap as incrementing a pointer.
+ *
+ * @tparam T Element type
+ * @tparam BlockSize Number of elements per block, or zero if set at run time
+ */
+template<class T, long BlockSize = 0>
+class block_iterator
+{
+public:
+    // Standard iterator typedefs for interop with C++ algorithms
+    using self_type = block_iterator;
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+private:
+    // Pointer to the current element
+    T* ptr_;
+    // Global index of the current element
+    long index_;
+    // Block size, if not known at compile time
+    long block_size_;
+    // Striped array of pointers to the blocks on each nodelet
+    T** blocks_;
+
+    // Recomputes the element pointer after moving to a new block
+    void seek()
+    {
+        long b = index_ / block_size();
+        long nlet = nlet_mod(b);
+        long local_block = nlet_div(b);
+        ptr_ = blocks_[nlet]
+            + local_block * block_size()
+            + (index_ - b * block_size());
+    }
+
+public:
+    block_iterator(T** blocks, long block_size, long index)
+    : ptr_(nullptr), index_(index), block_size_(block_size), blocks_(blocks)
+    { if (blocks_) { seek(); } }
+
+    // Number of elements in each block
+    long block_size() const
+    {
+        if constexpr (BlockSize > 0) { return BlockSize; }
+        else { return block_size_; }
+    }
+    // Raw pointer to the current element, valid until the end of the block
+    T* ptr() const { return ptr_; }
+    // Global index of the current element
+    long index() const { return index_; }
+    // Number of elements between here and the end of the block
+    long block_remaining() const
+    {
+        return block_size() - index_ % block_size();
+    }
+
+    reference  operator*()                      { return *ptr_; }
+    reference  operator*() const                { return *ptr_; }
+    pointer    operator->()                     { return ptr_; }
+    pointer    operator->() const               { return ptr_; }
+    reference  operator[](difference_type i)    { return *(*(this) + i); }
+
+    self_type& operator+=(difference_type n)
+    {
+        index_ += n;
+        seek();
+        return *this;
+    }
+    self_type& operator-=(difference_type n)    { return operator+=(-n); }
+    self_type& operator++()
+    {
+        ++index_;
+        // Stay within the block if we can, otherwise find the next one
+        if (index_ % block_size() == 0) { seek(); } else { ++ptr_; }
+        return *this;
+    }
+    self_type& operator--()                     { return operator+=(-1); }
+    self_type  operator++(int)            { self_type tmp = *this; this->operator++(); return tmp; }
+    self_type  operator--(int)            { self_type tmp = *this; this->operator--(); return tmp; }
+
+    // Compare iterators
+    friend bool
+    operator==(const self_type& lhs, const self_type& rhs) { return lhs.index_ == rhs.index_; }
+    friend bool
+    operator!=(const self_type& lhs, const self_type& rhs) { return lhs.index_ != rhs.index_; }
+    friend bool
+    operator< (const self_type& lhs, const self_type& rhs) { return lhs.index_ <  rhs.index_; }
+    friend bool
+    operator> (const self_type& lhs, const self_type& rhs) { return lhs.index_ >  rhs.index_; }
+    friend bool
+    operator<=(const self_type& lhs, const self_type& rhs) { return lhs.index_ <= rhs.index_; }
+    friend bool
+    operator>=(const self_type& lhs, const self_type& rhs) { return lhs.index_ >= rhs.index_; }
+
+    // Add/subtract integer to iterator
+    friend self_type
+    operator+ (const self_type& iter, difference_type n)
+    {
+        self_type tmp = iter;
+        tmp += n;
+        return tmp;
+    }
+    friend self_type
+    operator+ (difference_type n, const self_type& iter)
+    {
+        self_type tmp = iter;
+        tmp += n;
+        return tmp;
+    }
+    friend self_type
+    operator- (const self_type& iter, difference_type n)
+    {
+        self_type tmp = iter;
+        tmp -= n;
+        return tmp;
+    }
+
+    // Difference between iterators
+    friend difference_type
+    operator- (const self_type& lhs, const self_type& rhs)
+    {
+        return lhs.index_ - rhs.index_;
+    }
+};
+
+/**
+ * Distributed array with a block-cyclic layout: the array is divided into
+ * blocks of contiguous elements, and the blocks are dealt out to the nodelets
+ * round-robin. Neighboring elements are on the same nodelet (except at block
+ * boundaries), which suits kernels with spatial locality such as stencils
+ * and sliding windows.
+ *
+ * Storage for each nodelet is allocated with mw_malloc2d. Elements are left
+ * uninitialized.
+ *
+ * @tparam T Element type
+ * @tparam BlockSize Number of elements per block, or zero to choose the block
+ * size at run time
+ */
+template<class T, long BlockSize = 0>
+class block_array
+{
+private:
+    repl<long> n_;
+    repl<long> block_size_;
+    // Striped array of pointers to the storage on each nodelet
+    repl<T**> blocks_;
+
+    static long blocks_per_nodelet(long n, long block_size)
+    {
+        long num_blocks = (n + block_size - 1) / block_size;
+        return (num_blocks + nodelets() - 1) / nodelets();
+    }
+
+    T** allocate(long n, long block_size)
+    {
+        size_t bytes = sizeof(T) * block_size * blocks_per_nodelet(n, block_size);
+        auto ptr = reinterpret_cast<T**>(mw_malloc2d(nodelets(), bytes));
+        if (!ptr) { EMU_OUT_OF_MEMORY(bytes * nodelets()); }
+        return ptr;
+    }
+
+public:
+    typedef T value_type;
+    typedef block_iterator<T, BlockSize> iterator;
+    typedef block_iterator<const T, BlockSize> const_iterator;
+
+    // Default constructor
+    block_array() : n_(0), block_size_(BlockSize), blocks_(nullptr) {}
+
+    /**
+     * Constructs a block_array<T> with a compile-time block size
+     * @param n Number of elements
+     */
+    explicit block_array(long n)
+    : n_(n)
+    , block_size_(BlockSize)
+    , blocks_(allocate(n, BlockSize))
+    {
+        static_assert(BlockSize > 0,
+            "Block size must be passed to the constructor");
+    }
+
+    /**
+     * Constructs a block_array<T> with a run-time block size
+     * @param n Number of elements
+     * @param block_size Number of contiguous elements in each block
+     */
+    block_array(long n, long block_size)
+    : n_(n)
+    , block_size_(block_size)
+    , blocks_(allocate(n, block_size))
+    {
+        assert(BlockSize == 0 || BlockSize == block_size);
+    }
+
+    ~block_array()
+    {
+        if (blocks_) { mw_free(blocks_); }
+    }
+
+    friend void
+    swap(block_array& first, block_array& second)
+    {
+        using std::swap;
+        swap(first.n_, second.n_);
+        swap(first.block_size_, second.block_size_);
+        swap(first.blocks_, second.blocks_);
+    }
+
+    // Copy constructor
+    block_array(const block_array & other) = delete;
+
+    // Assignment operator (using copy-and-swap idiom)
+    block_array& operator= (block_array other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+
+    // Move constructor (using copy-and-swap idiom)
+    block_array(block_array&& other) noexcept : block_array()
+    {
+        swap(*this, other);
+    }
+
+    // Shallow copy constructor (used for repl<T>)
+    block_array(const block_array& other, shallow_copy)
+    : n_(other.n_), block_size_(other.block_size_), blocks_(other.blocks_) {}
+
+    long size() const { return n_; }
+
+    long block_size() const
+    {
+        if constexpr (BlockSize > 0) { return BlockSize; }
+        else { return block_size_; }
+    }
+
+    long num_blocks() const { return (n_ + block_size() - 1) / block_size(); }
+
+    // Returns the nodelet that holds block b
+    long block_nodelet(long b) const { return nlet_mod(b); }
+
+    // Returns a pointer to the first element of block b
+    T* block(long b)
+    {
+        return blocks_[nlet_mod(b)] + nlet_div(b) * block_size();
+    }
+
+    iterator begin ()               { return iterator(blocks_, block_size(), 0); }
+    iterator end ()                 { return iterator(blocks_, block_size(), n_); }
+    const_iterator begin () const
+    {
+        return const_iterator(const_cast<const T**>(static_cast<T**>(blocks_)), block_size(), 0);
+    }
+    const_iterator end () const
+    {
+        return const_iterator(const_cast<const T**>(static_cast<T**>(blocks_)), block_size(), n_);
+    }
+
+    T& operator[] (long i) { return *(begin() + i); }
+};
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+// Returns the first block on nlet at or after block b
+inline long
+next_block_on(long nlet, long b)
+{
+    return b + nlet_mod(nlet - nlet_mod(b) + nodelets());
+}
+
+// Returns the index of the first element of [begin, end) on nlet,
+// or end.index() if there are none
+template<class T, long BlockSize>
+long
+first_on_nodelet(long nlet,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end)
+{
+    long block_size = begin.block_size();
+    long b = next_block_on(nlet, begin.index() / block_size);
+    return std::min(std::max(b * block_size, begin.index()), end.index());
+}
+
+/**
+ * Calls f(first, last) with a pair of raw pointers for each block (or partial
+ * block) of [begin, end) that is stored on nlet. Blocks are visited in order.
+ */
+template<class T, long BlockSize, class Function>
+void
+for_each_local_block(
+    long nlet,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    Function f
+) {
+    long block_size = begin.block_size();
+    long last_block = (end.index() - 1) / block_size;
+    for (long b = next_block_on(nlet, begin.index() / block_size);
+         b <= last_block; b += nodelets()) {
+        // Clip the block to the range
+        long first = std::max(b * block_size, begin.index());
+        long last = std::min((b + 1) * block_size, end.index());
+        auto block_begin = begin + (first - begin.index());
+        f(block_begin.ptr(), block_begin.ptr() + (last - first));
+    }
+}
+
+/**
+ * Spawns a thread on each nodelet in [nlet_begin, nlet_end) that holds part of
+ * [begin, end), which calls f(nlet). The policy sets the spawn radix.
+ */
+template<class Policy, class T, long BlockSize, class Function>
+void
+block_spawn(
+    Policy policy,
+    long nlet_begin, long nlet_end,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    Function f
+) {
+    // Recursive spawn
+    // Stop splitting once we are down to spawn_radix nodelets
+    const long nlet_radix = get_spawn_radix(policy);
+    for(;;) {
+        // How many nodelets do we need to spawn on?
+        auto nlet_count = nlet_end - nlet_begin;
+        if (nlet_count <= nlet_radix) { break; }
+        // Divide the nodelets in half
+        long nlet_mid = nlet_begin + nlet_count / 2;
+        // Spawn a thread to handle the upper half
+        long mid = first_on_nodelet(nlet_mid, begin, end);
+        if (mid < end.index()) {
+            cilk_migrate_hint((begin + (mid - begin.index())).ptr());
+        }
+        cilk_spawn block_spawn(policy, nlet_mid, nlet_end, begin, end, f);
+        // Recurse over the lower half
+        nlet_end = nlet_mid;
+    }
+
+    // Serial spawn
+    for (long nlet = nlet_begin; nlet < nlet_end; ++nlet) {
+        // Find the first element of the range on this nodelet
+        long first = first_on_nodelet(nlet, begin, end);
+        if (first >= end.index()) { continue; }
+        auto nlet_begin_it = begin + (first - begin.index());
+        // Spawn a thread on the nodelet
+        cilk_migrate_hint(nlet_begin_it.ptr());
+        cilk_spawn f(nlet);
+    }
+}
+
+/**
+ * Grain size for the part of a block-cyclic range on a single nodelet.
+ * Static and dynamic policies limit the number of threads on the nodelet;
+ * the blocks are already divided evenly, so dynamic is treated as static.
+ */
+template<class Policy, class T, long BlockSize>
+long
+local_block_grain(
+    Policy policy, long nlet,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end
+) {
+    long grain = get_grain(policy);
+    if constexpr (is_parallel_policy_v<Policy>) {
+        return grain;
+    } else {
+        long n = 0;
+        for_each_local_block(nlet, begin, end,
+            [&](T* first, T* last) { n += last - first; });
+        long max_threads = get_threads_per_nodelet(policy);
+        if (n / grain > max_threads) { grain = n / max_threads; }
+        return grain;
+    }
+}
+
+// Spawns a thread for each grain of the blocks of [begin, end) on nlet
+template<class Policy, class T, long BlockSize, class UnaryFunction>
+void
+block_for_each_nodelet(
+    Policy policy, long nlet,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    UnaryFunction worker
+) {
+    long grain = local_block_grain(policy, nlet, begin, end);
+    long block_size = begin.block_size();
+    long last_block = (end.index() - 1) / block_size;
+    for (long b = next_block_on(nlet, begin.index() / block_size);
+         b <= last_block; b += nodelets()) {
+        // Clip the block to the range
+        long first = std::max(b * block_size, begin.index());
+        long last = std::min((b + 1) * block_size, end.index());
+        T* ptr = (begin + (first - begin.index())).ptr();
+        // Grains do not cross block boundaries
+        for (long i = 0; i < last - first; i += grain) {
+            long n = std::min(grain, last - first - i);
+            cilk_spawn for_each_grain(policy, ptr + i, ptr + i + n, worker);
+        }
+    }
+}
+
+template<class Policy, class T, long BlockSize, class U, class BinaryOp>
+reduce_partial<U>
+block_reduce_tree(
+    Policy policy, long grain, long b, long num_blocks,
+    block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+    U init, BinaryOp binary_op);
+
+// Reduces a subtree of blocks in a spawned thread
+// The thread counts against the thread budget of its nodelet while it runs
+template<class Policy, class T, long BlockSize, class U, class BinaryOp>
+reduce_partial<U>
+block_reduce_subtree(
+    Policy policy, long grain, long b, long num_blocks,
+    block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+    U init, BinaryOp binary_op
+) {
+    thread_budget_guard guard;
+    return block_reduce_tree(policy, grain, b, num_blocks,
+        first, last, init, binary_op);
+}
+
+/**
+ * Reduces num_blocks blocks of [first, last), starting with block b and
+ * stepping by nodelets(), with a binary tree of spawns. Each leaf is a single
+ * block, which is reduced with reduce_tree, so every grain of every local
+ * block is spawned without waiting for the other blocks to finish. Like
+ * reduce_tree, init is only a placeholder and is not folded into the result.
+ */
+template<class Policy, class T, long BlockSize, class U, class BinaryOp>
+reduce_partial<U>
+block_reduce_tree(
+    Policy policy, long grain, long b, long num_blocks,
+    block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+    U init, BinaryOp binary_op
+) {
+    if (num_blocks == 1) {
+        // Clip the block to the range
+        long block_size = first.block_size();
+        long lo = std::max(b * block_size, first.index());
+        long hi = std::min((b + 1) * block_size, last.index());
+        T* ptr = (first + (lo - first.index())).ptr();
+        return reduce_tree(policy, grain, ptr, ptr + (hi - lo),
+            init, binary_op, never_cancelled{});
+    }
+    long half = num_blocks / 2;
+    reduce_partial<U> left = cilk_spawn block_reduce_subtree(policy, grain,
+        b, half, first, last, init, binary_op);
+    reduce_partial<U> right = block_reduce_tree(policy, grain,
+        b + half * nodelets(), num_blocks - half, first, last, init, binary_op);
+    cilk_sync;
+    return combine_partials(left, right, binary_op);
+}
+
+// Reduces the blocks of [first, last) on nlet into the nlet'th partial sum
+template<class Policy, class T, long BlockSize, class U, class BinaryOp>
+void
+block_reduce_nodelet(
+    Policy policy, long nlet,
+    block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+    U init, BinaryOp binary_op, repl<reduce_partial<U>>* partials
+) {
+    long grain = local_block_grain(policy, nlet, first, last);
+    long block_size = first.block_size();
+    long first_block = next_block_on(nlet, first.index() / block_size);
+    long last_block = (last.index() - 1) / block_size;
+    long num_blocks = (last_block - first_block) / nodelets() + 1;
+    partials->get_nth(nlet) = block_reduce_tree(policy, grain,
+        first_block, num_blocks, first, last, init, binary_op);
+}
+
+// Runs a block task in a spawned thread that counts against the budget
+template<class Function>
+void
+block_task(Function f, long b)
+{
+    thread_budget_guard guard;
+    f(b);
+}
+
+/**
+ * Calls f(b) for each block b of the block_array, on the nodelet that holds
+ * the block. Parallel policies spawn a thread per nodelet, which spawns a
+ * task for each of its blocks.
+ */
+template<class Policy, class T, class Function>
+void
+for_each_block(Policy policy, block_array<T>& blocks, long num_blocks,
+    Function f)
+{
+    if (num_blocks == 0) {
+        return;
+    } else if constexpr (std::is_same_v<Policy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            for_each_block(policy, blocks, num_blocks, f);
+        });
+    } else if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        for (long b = 0; b < num_blocks; ++b) { f(b); }
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        for_each_block(remove_parallel_t<Policy>(), blocks, num_blocks, f);
+    } else {
+        long block_size = blocks.block_size();
+        auto begin = blocks.begin();
+        auto end = begin + num_blocks * block_size;
+        block_spawn(policy, 0, nodelets(), begin, end, [=](long nlet) {
+            for (long b = nlet; b < num_blocks; b += nodelets()) {
+                cilk_spawn block_task(f, b);
+            }
+        });
+    }
+}
+
+} // end namespace detail
+
+/**
+ * for_each over a block_array. Each block is processed on the nodelet that
+ * owns it, using raw pointers within the block.
+ *
+ * Parallel policies spawn a thread on each nodelet, which splits its blocks
+ * into grains. Serial policies visit the blocks in order.
+ */
+template<class Policy, class T, long BlockSize, class UnaryFunction,
+   // Disable if first argument is not an execution policy
+   // The default policy is resolved by the overload below
+   std::enable_if_t<is_execution_policy_v<Policy>
+       && !std::is_same_v<Policy, default_policy_t>, int> = 0
+>
+void
+for_each(
+   Policy policy,
+   block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+   UnaryFunction worker
+){
+   using serial_policy = remove_parallel_t<Policy>;
+   if (end - begin == 0) {
+       return;
+   } else if constexpr (std::is_same_v<serial_policy, Policy>) {
+       // Walk through the blocks in order
+       while (begin < end) {
+           long n = std::min<long>(begin.block_remaining(), end - begin);
+           detail::for_each(policy, begin.ptr(), begin.ptr() + n, worker);
+           begin += n;
+       }
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       for_each(serial_policy(), begin, end, worker);
+   } else {
+       detail::block_spawn(policy, 0, nodelets(), begin, end, [=](long nlet) {
+           detail::block_for_each_nodelet(policy, nlet, begin, end, worker);
+       });
+   }
+}
+
+/**
+ * reduce over a block_array. Each nodelet reduces its own blocks into a
+ * replicated partial sum, then the partial sums are combined.
+ */
+template<class Policy, class T, long BlockSize,
+   class U = std::remove_const_t<T>, class BinaryOp = std::plus<>,
+   // Disable if first argument is not an execution policy
+   // The default policy is resolved by the overload below
+   std::enable_if_t<is_execution_policy_v<Policy>
+       && !std::is_same_v<Policy, default_policy_t>, int> = 0
+>
+U
+reduce(
+   Policy policy,
+   block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+   U init = U{}, BinaryOp binary_op = std::plus<>()
+){
+   using serial_policy = remove_parallel_t<Policy>;
+   if (last - first == 0) {
+       return init;
+   } else if constexpr (std::is_same_v<serial_policy, Policy>) {
+       // Walk through the blocks in order
+       while (first < last) {
+           long n = std::min<long>(first.block_remaining(), last - first);
+           init = detail::reduce(seq, first.ptr(), first.ptr() + n,
+               init, binary_op);
+           first += n;
+       }
+       return init;
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       return reduce(serial_policy(), first, last, init, binary_op);
+   } else {
+       // Allocate a partial sum on each nodelet
+       // Nodelets that hold no part of the range contribute nothing
+       auto partials = emu::make_repl<detail::reduce_partial<U>>(
+           detail::reduce_partial<U>{init, false});
+       repl<detail::reduce_partial<U>>* partials_ptr = partials.get();
+       detail::block_spawn(policy, 0, nodelets(), first, last, [=](long nlet) {
+           detail::block_reduce_nodelet(policy, nlet, first, last,
+               init, binary_op, partials_ptr);
+       });
+       // Reduce across the partial sums, then fold in init once
+       return detail::fold_init(init, repl_reduce(*partials,
+           [=](const auto& lhs, const auto& rhs) {
+               return detail::combine_partials(lhs, rhs, binary_op);
+           }), binary_op);
+   }
+}
+
+// Default policy: pick the schedule from the runtime configuration
+// These must be declared here, since the generic overloads can't see the ones
+// above
+template<class T, long BlockSize, class UnaryFunction>
+void
+for_each(
+   default_policy_t,
+   block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+   UnaryFunction worker
+){
+   visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+       for_each(policy, begin, end, worker);
+   });
+}
+
+template<class T, long BlockSize, class UnaryFunction>
+void
+for_each(block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end, UnaryFunction worker)
+{
+   for_each(emu::default_policy, begin, end, worker);
+}
+
+template<class T, long BlockSize,
+   class U = std::remove_const_t<T>, class BinaryOp = std::plus<>>
+U
+reduce(
+   default_policy_t,
+   block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+   U init = U{}, BinaryOp binary_op = std::plus<>()
+){
+   return visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+       return reduce(policy, first, last, init, binary_op);
+   });
+}
+
+template<class T, long BlockSize,
+   class U = std::remove_const_t<T>, class BinaryOp = std::plus<>>
+U
+reduce(
+   block_iterator<T, BlockSize> first, block_iterator<T, BlockSize> last,
+   U init = U{}, BinaryOp binary_op = std::plus<>()
+){
+   return reduce(emu::default_policy, first, last, init, binary_op);
+}
+
+} // end namespace emu::parallel
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "pointer_manipulation.h"
+#include "out_of_memory.h"
+
+namespace emu {
+
+/**
+ * Token type used by algorithms that were not given a cancellation token.
+ * The check is a compile-time constant, so it costs nothing.
+ */
+struct never_cancelled
+{
+    constexpr bool is_cancelled() const { return false; }
+};
+
+/**
+ * Lightweight handle to a cancellation_token. This is what gets passed into
+ * the parallel algorithms and captured by worker functions.
+ *
+ * Holds a nodelet-relative (view-0) pointer to the replicated flag, so
+ * checking for cancellation always reads the local copy and never migrates.
+ */
+class cancellation_ref
+{
+private:
+    volatile long * flag_;
+public:
+    explicit cancellation_ref(volatile long * flag) : flag_(flag) {}
+
+    // Returns true if the token has been cancelled
+    bool is_cancelled() const { return *flag_ != 0; }
+
+    // Request cancellation: writes the flag on every nodelet
+    void cancel() const
+    {
+        for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+            *pmanip::get_nth(flag_, nlet) = 1;
+        }
+    }
+};
+
+/**
+ * Allows a running parallel algorithm to be cancelled early.
+ *
+ * Cilk can't terminate threads, so cancellation is cooperative. Worker threads
+ * check the flag between grains, so a cancelled loop will end after at most
+ * one more grain per worker. Cancelling costs one write to each nodelet,
+ * checking the flag is a local read.
+ *
+ * The flag lives in replicated storage, so the token itself can be created on
+ * the stack. Pass ref() into worker functions rather than capturing the token
+ * by reference, to avoid migrating back to the token's home nodelet.
+ */
+class cancellation_token
+{
+private:
+    // Nodelet-relative (view-0) pointer to the flag
+    long * flag_;
+
+    static long * allocate()
+    {
+        auto ptr = reinterpret_cast<long*>(mw_mallocrepl(sizeof(long)));
+        if (!ptr) { EMU_OUT_OF_MEMORY(sizeof(long) * NODELETS()); }
+        return ptr;
+    }
+
+public:
+    cancellation_token() : flag_(allocate()) { reset(); }
+
+    ~cancellation_token() { mw_free(flag_); }
+
+    cancellation_token(const cancellation_token&) = delete;
+    cancellation_token& operator=(const cancellation_token&) = delete;
+
+    // Returns a handle that can be passed to algorithms and worker functions
+    cancellation_ref ref() const { return cancellation_ref(flag_); }
+    operator cancellation_ref() const { return ref(); }
+
+    bool is_cancelled() const { return ref().is_cancelled(); }
+
+    void cancel() { ref().cancel(); }
+
+    // Clear the flag on every nodelet so the token can be used again
+    void reset()
+    {
+        for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+            *pmanip::get_nth(flag_, nlet) = 0;
+        }
+    }
+};
+
+} // end namespace emu
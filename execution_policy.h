@@ -1,7 +1,14 @@
 #pragma once
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
 #include <emu_c_utils/emu_c_utils.h>
 #include "pointer_manipulation.h"
+#include "nodelets.h"
+#include "stripe_layout.h"
 
 #ifndef EMU_CXX_SPAWN_RADIX
 #define EMU_CXX_SPAWN_RADIX 16
@@ -19,7 +26,7 @@ template<class T>
 void *
 ptr_from_iter(T* ptr)
 {
-    return ptr;
+    return const_cast<std::remove_const_t<T>*>(ptr);
 }
 
 // For any other iterator type,
@@ -54,6 +61,9 @@ struct grain_policy
     static constexpr long grain = Grain;
 };
 
+// Grain size placeholder: look up the grain size in the runtime configuration
+constexpr long runtime_grain = 0;
+
 // Execute loop iterations one at a time, in a single thread
 struct sequenced_policy {};
 // Unroll and reorder statements in the innermost loop to minimize migrations
@@ -81,6 +91,10 @@ struct dynamic_unroll_policy : public dynamic_policy<Grain> {};
 // Tags for downgrading a parallel policy to a serial policy
 template<class Policy> struct remove_parallel;
 template<class T> using remove_parallel_t = typename remove_parallel<T>::type;
+template<> struct remove_parallel<sequenced_policy> {
+    using type = sequenced_policy; };
+template<> struct remove_parallel<unroll_policy> {
+    using type = unroll_policy; };
 template<long Grain> struct remove_parallel<parallel_policy<Grain>> {
     using type = sequenced_policy; };
 template<long Grain> struct remove_parallel<parallel_unroll_policy<Grain>> {
@@ -111,7 +125,9 @@ inline constexpr parallel_unroll_policy<default_grain>  par_unroll   {};
 inline constexpr static_unroll_policy<default_grain>    fixed_unroll {};
 inline constexpr dynamic_unroll_policy<4>               dyn_unroll   {};
 
-inline constexpr auto default_policy =    fixed;
+// Tag for the policy selected at run time (see runtime_config below)
+struct default_policy_t {};
+inline constexpr default_policy_t                       default_policy {};
 
 // Traits for checking whether a tag is an execution policy
 template<class T> struct is_execution_policy : std::false_type {};
@@ -119,6 +135,7 @@ template<class T>
 inline constexpr bool is_execution_policy_v = is_execution_policy<T>::value;
 
 template<> struct is_execution_policy<sequenced_policy> : std::true_type {};
+template<> struct is_execution_policy<default_policy_t> : std::true_type {};
 template<long Grain> struct is_execution_policy<parallel_policy<Grain>> : std::true_type {};
 template<long Grain> struct is_execution_policy<static_policy<Grain>> : std::true_type {};
 template<long Grain> struct is_execution_policy<dynamic_policy<Grain>> : std::true_type {};
@@ -148,15 +165,245 @@ inline constexpr bool is_dynamic_policy_v = is_dynamic_policy<T>::value;
 template<long Grain> struct is_dynamic_policy<dynamic_policy<Grain>> : std::true_type {};
 template<long Grain> struct is_dynamic_policy<dynamic_unroll_policy<Grain>> : std::true_type {};
 
+// Traits for checking whether a policy tag reads its parameters from the runtime config
+template<class T> struct is_runtime_policy : std::false_type {};
+template<class T>
+inline constexpr bool is_runtime_policy_v = is_runtime_policy<T>::value;
+template<> struct is_runtime_policy<default_policy_t> : std::true_type {};
+template<> struct is_runtime_policy<parallel_policy<runtime_grain>> : std::true_type {};
+template<> struct is_runtime_policy<static_policy<runtime_grain>> : std::true_type {};
+template<> struct is_runtime_policy<dynamic_policy<runtime_grain>> : std::true_type {};
+template<> struct is_runtime_policy<parallel_unroll_policy<runtime_grain>> : std::true_type {};
+template<> struct is_runtime_policy<static_unroll_policy<runtime_grain>> : std::true_type {};
+template<> struct is_runtime_policy<dynamic_unroll_policy<runtime_grain>> : std::true_type {};
+
+// Schedules that can be selected for default_policy at run time
+enum class policy_kind {
+    seq, unroll, par, par_unroll, fixed, fixed_unroll, dyn, dyn_unroll
+};
+
+/**
+ * Tuning parameters that are consulted when an algorithm is called with
+ * default_policy (or with no policy at all). Explicitly templated policies
+ * like parallel_policy<64> ignore everything here.
+ */
+struct runtime_config
+{
+    // Schedule to use for default_policy
+    policy_kind policy = policy_kind::fixed;
+    // Grain size used by policies with runtime_grain
+    long grain = default_grain;
+    // Grain size used by dynamic policies with runtime_grain. Zero means the
+    // grain size of the dyn and dyn_unroll tags (1 and 4 elements)
+    long dynamic_grain = 0;
+    // Target number of threads per nodelet used by policies with runtime_grain
+    long threads_per_nodelet = emu::threads_per_nodelet;
+    // Max number of threads to spawn within a single thread
+    long spawn_radix = emu::spawn_radix;
+    // Nested parallel calls run serially once a nodelet has this many
+    // active worker threads (see thread_budget.h)
+    long thread_budget = emu::threads_per_nodelet;
+};
+
+namespace detail {
+// There is a copy on each nodelet, so reading the config never migrates
+inline replicated runtime_config the_runtime_config;
+} // end namespace detail
+
+// Returns the local copy of the runtime configuration
+inline const runtime_config&
+get_runtime_config()
+{
+    return detail::the_runtime_config;
+}
+
+// Writes a new runtime configuration to every nodelet, and fills in the
+// replicated divider used by stripe_layout
+// Must not be called while an algorithm is running
+inline void
+set_runtime_config(const runtime_config& config)
+{
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        *pmanip::get_nth(&detail::the_runtime_config, nlet) = config;
+    }
+    init_nodelet_divider();
+}
+
+namespace detail {
+
+// Parses a positive long from an environment variable, or returns fallback
+inline long
+getenv_long(const char* name, long fallback)
+{
+    const char* str = getenv(name);
+    if (!str) { return fallback; }
+    char* end;
+    long value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value <= 0) {
+        printf("Invalid value for %s: '%s', exiting\n", name, str);
+        fflush(stdout);
+        exit(1);
+    }
+    return value;
+}
+
+// Parses a policy name from an environment variable, or returns fallback
+inline policy_kind
+getenv_policy(const char* name, policy_kind fallback)
+{
+    const char* str = getenv(name);
+    if (!str) { return fallback; }
+    // Names match the global policy tag objects
+    const char* names[] = {
+        "seq", "unroll", "par", "par_unroll",
+        "fixed", "fixed_unroll", "dyn", "dyn_unroll"
+    };
+    for (long i = 0; i < 8; ++i) {
+        if (strcmp(str, names[i]) == 0) { return static_cast<policy_kind>(i); }
+    }
+    printf("Invalid value for %s: '%s', exiting\n", name, str);
+    fflush(stdout);
+    exit(1);
+}
+
+} // end namespace detail
+
+/**
+ * Builds a runtime configuration from the environment. Each setting that is
+ * not present keeps its compile-time default.
+ * - EMU_CXX_POLICY: one of seq, unroll, par, par_unroll, fixed, fixed_unroll,
+ *   dyn, dyn_unroll
+ * - EMU_CXX_GRAIN
+ * - EMU_CXX_THREADS_PER_NODELET
+ * - EMU_CXX_SPAWN_RADIX
+ * - EMU_CXX_THREAD_BUDGET
+ */
+inline runtime_config
+runtime_config_from_env()
+{
+    runtime_config config;
+    config.policy = detail::getenv_policy("EMU_CXX_POLICY", config.policy);
+    config.grain = detail::getenv_long("EMU_CXX_GRAIN", config.grain);
+    // An explicit grain size applies to the dynamic schedules too
+    if (getenv("EMU_CXX_GRAIN")) { config.dynamic_grain = config.grain; }
+    config.threads_per_nodelet = detail::getenv_long(
+        "EMU_CXX_THREADS_PER_NODELET", config.threads_per_nodelet);
+    config.spawn_radix = detail::getenv_long(
+        "EMU_CXX_SPAWN_RADIX", config.spawn_radix);
+    config.thread_budget = detail::getenv_long(
+        "EMU_CXX_THREAD_BUDGET", config.thread_budget);
+    return config;
+}
+
+// Call once at startup to apply settings from the environment
+inline void
+init_runtime_config()
+{
+    if (nodelets() != NODELETS()) {
+        printf("Compiled for %li nodelets, but running on %li, exiting\n",
+            nodelets(), (long)NODELETS());
+        fflush(stdout);
+        exit(1);
+    }
+    set_runtime_config(runtime_config_from_env());
+}
+
+// Returns the grain size of a policy, consulting the runtime config if needed
+template<class Policy>
+inline long
+get_grain(Policy)
+{
+    if constexpr (is_runtime_policy_v<Policy> && is_dynamic_policy_v<Policy>) {
+        // Claim as few elements at a time as the dyn and dyn_unroll tags do,
+        // unless the config sets a dynamic grain size
+        long grain = get_runtime_config().dynamic_grain;
+        if (grain > 0) { return grain; }
+        if constexpr (std::is_same_v<Policy,
+            dynamic_unroll_policy<runtime_grain>>) {
+            return decltype(dyn_unroll)::grain;
+        } else {
+            return decltype(dyn)::grain;
+        }
+    } else if constexpr (is_runtime_policy_v<Policy>) {
+        return get_runtime_config().grain;
+    } else {
+        return Policy::grain;
+    }
+}
+
+// Returns the target number of threads per nodelet for a policy
+template<class Policy>
+inline long
+get_threads_per_nodelet(Policy)
+{
+    if constexpr (is_runtime_policy_v<Policy>) {
+        return get_runtime_config().threads_per_nodelet;
+    } else {
+        return threads_per_nodelet;
+    }
+}
+
+// Returns the max number of threads to spawn within a single thread
+template<class Policy>
+inline long
+get_spawn_radix(Policy)
+{
+    if constexpr (is_runtime_policy_v<Policy>) {
+        return get_runtime_config().spawn_radix;
+    } else {
+        return spawn_radix;
+    }
+}
+
+/**
+ * Calls f with the policy selected by the runtime configuration. All parallel
+ * policies use runtime_grain, so they also pick up grain and thread count
+ * from the config. The dynamic ones use runtime_config::dynamic_grain, which
+ * defaults to the grain size of the dyn and dyn_unroll tags.
+ *
+ * @tparam AllowDynamic Whether the algorithm supports a dynamic schedule on
+ * this iterator type. If not, the static schedule is used instead.
+ */
+template<bool AllowDynamic, class Function>
+decltype(auto)
+visit_default_policy(Function f)
+{
+    switch (get_runtime_config().policy) {
+        case policy_kind::seq:
+            return f(sequenced_policy());
+        case policy_kind::unroll:
+            return f(unroll_policy());
+        case policy_kind::par:
+            return f(parallel_policy<runtime_grain>());
+        case policy_kind::par_unroll:
+            return f(parallel_unroll_policy<runtime_grain>());
+        case policy_kind::dyn:
+            if constexpr (AllowDynamic) {
+                return f(dynamic_policy<runtime_grain>());
+            }
+            [[fallthrough]];
+        case policy_kind::fixed:
+            return f(static_policy<runtime_grain>());
+        case policy_kind::dyn_unroll:
+            if constexpr (AllowDynamic) {
+                return f(dynamic_unroll_policy<runtime_grain>());
+            }
+            [[fallthrough]];
+        case policy_kind::fixed_unroll:
+        default:
+            return f(static_unroll_policy<runtime_grain>());
+    }
+}
+
 // Adjusts the grain size so we don't spawn too many threads
 template<class Policy, class Iterator>
 inline long
 compute_fixed_grain(Policy policy, Iterator begin, Iterator end)
 {
     // Calculate a fixed grain size so we spawn exactly enough threads
-    long max_threads = threads_per_nodelet;
+    long max_threads = get_threads_per_nodelet(policy);
     long n = std::distance(begin, end);
-    long grain = Policy::grain;
+    long grain = get_grain(policy);
     long n_threads = n / grain;
     if (n_threads > max_threads) {
         grain = n / max_threads;
@@ -50,9 +50,9 @@ public:
     FILE* operator[](long nlet) { return files_[nlet]; }
 
     explicit fileset(const char* basename, const char* mode)
-    : files_(NODELETS())
+    : files_(nodelets())
     {
-        const long num_nlets = NODELETS();
+        const long num_nlets = nodelets();
         for (long nlet = 0; nlet < num_nlets; ++nlet) {
             // Append suffix to each file: <nlet>of<nlets>
             std::ostringstream oss;
@@ -72,7 +72,7 @@ public:
     ~fileset()
     {
         // Close all the files
-        const long num_nlets = NODELETS();
+        const long num_nlets = nodelets();
         for (long nlet = 0; nlet < num_nlets; ++nlet) {
             mw_fclose(files_[nlet]);
         }
@@ -86,7 +86,7 @@ template<class T>
 void serialize(fileset& f, repl<T>& item)
 {
     // Write the nth copy to the nth file
-    const long num_nlets = NODELETS();
+    const long num_nlets = nodelets();
     for (long nlet = 0; nlet < num_nlets; ++nlet) {
         size_t n = mw_fwrite(&item.get_nth(nlet), sizeof(T), 1, f[nlet]);
         if (n != 1) {
@@ -102,7 +102,7 @@ template<class T>
 void deserialize(fileset& f, repl<T>& item)
 {
     // Read the nth copy to the nth file
-    const long num_nlets = NODELETS();
+    const long num_nlets = nodelets();
     for (long nlet = 0; nlet < num_nlets; ++nlet) {
         size_t n = mw_fread(&item.get_nth(nlet), sizeof(T), 1, f[nlet]);
         if (n != 1) {
@@ -113,17 +113,24 @@ void deserialize(fileset& f, repl<T>& item)
     }
 }
 
-// Serialize a striped_array<T> to a fileset
+/**
+ * Serialize a striped_array<T> to a fileset
+ *
+ * Each slice holds the elements stored on its nodelet, so every thread writes
+ * to a local file. The slices depend on the array's first nodelet; deserialize
+ * into an array that starts on the same nodelet.
+ */
 template<class T>
 void serialize(fileset& f, striped_array<T>& array)
 {
     // Spawn a thread for each nodelet
-    const long num_nlets = NODELETS();
+    const long num_nlets = nodelets();
+    const stripe_layout layout = array.layout();
     emu::parallel::for_each(emu::parallel_policy<1>(),
         array.begin(), array.begin() + num_nlets,
         [&](T& stripe_first) {
-            // Get the file associated with this nodelet
-            long nlet = &stripe_first - array.begin();
+            // Get the file associated with the nodelet that holds this stripe
+            long nlet = layout.nodelet(&stripe_first - array.begin());
             FILE *fp = f[nlet];
 
             // Save the size of the array to all slices
@@ -134,8 +141,7 @@ void serialize(fileset& f, striped_array<T>& array)
             // Get a pointer to the local stripe
             long *stripe = emu::pmanip::view2to1(&stripe_first);
             // Compute length of local stripe
-            size_t stripe_len = array.size() / num_nlets;
-            if (nlet < array.size() % num_nlets) { stripe_len += 1; }
+            size_t stripe_len = layout.count(nlet);
             //LOG("nlet[%li]: Writing %li items\n", nlet, stripe_len);
             // Write the stripe to the file
             size_t n = mw_fwrite(stripe, sizeof(T), stripe_len, fp);
@@ -149,11 +155,12 @@ void serialize(fileset& f, striped_array<T>& array)
 }
 
 // Deserialize a striped_array<T> from a fileset
-// Contents of the array will be overwritten
+// Contents of the array will be overwritten. The array keeps its first
+// nodelet, which must match the array that was serialized.
 template<class T>
 void deserialize(fileset& f, striped_array<T>& array)
 {
-    const long num_nlets = NODELETS();
+    const long num_nlets = nodelets();
 
     // Read size of array from all slices
     auto length = emu::make_repl<long>();
@@ -164,18 +171,18 @@ void deserialize(fileset& f, striped_array<T>& array)
     array.resize(*length);
 
     // Spawn a thread for each nodelet
+    const stripe_layout layout = array.layout();
     emu::parallel::for_each(emu::parallel_policy<1>(),
         array.begin(), array.begin() + num_nlets,
         [&](T& stripe_first) {
-            // Get the file associated with this nodelet
-            long nlet = &stripe_first - array.begin();
+            // Get the file associated with the nodelet that holds this stripe
+            long nlet = layout.nodelet(&stripe_first - array.begin());
             FILE *fp = f[nlet];
 
             // Get a pointer to the local stripe
             long *stripe = emu::pmanip::view2to1(&stripe_first);
             // Compute length of local stripe
-            size_t stripe_len = array.size() / num_nlets;
-            if (nlet < array.size() % num_nlets) { stripe_len += 1; }
+            size_t stripe_len = layout.count(nlet);
             //LOG("nlet[%li]: Reading %li items\n", nlet, stripe_len);
             // Read the stripe from the file
             size_t n = mw_fread(stripe, sizeof(T), stripe_len, fp);
@@ -193,7 +200,7 @@ template<class T>
 void serialize(fileset& f, repl_array<T>& array)
 {
     // Spawn a thread for each nodelet
-    const long num_nlets = NODELETS();
+    const long num_nlets = nodelets();
     for (long nlet = 0; nlet < num_nlets; ++ nlet) {
         // Get the file associated with this nodelet
         FILE *fp = f[nlet];
@@ -219,7 +226,7 @@ template<class T>
 void deserialize(fileset& f, repl_array<T>& array)
 {
     // Spawn a thread for each nodelet
-    const long num_nlets = NODELETS();
+    const long num_nlets = nodelets();
     // Read size of array from all slices
     auto length = emu::make_repl<long>();
     deserialize(f, *length);
@@ -54,9 +54,9 @@ ForwardIt find_if(unroll_policy, ForwardIt first, ForwardIt last,
 // TODO: implement parallel find.
 // Notes:
 // - Parent can't terminate threads in cilk, so even if we find the value early,
-// still have to wait for all threads to finish. (I guess we could have each
-// thread check a shared variable for early termination, but that would
-// increase contention and migrations.)
+// still have to wait for all threads to finish. A cancellation_token can be
+// used to stop the remaining grains; it is replicated, so checking it
+// doesn't cause contention or migrations.
 // - If multiple threads find an item, spec says we need to return the first
 // match. But this may be unnecessary in many cases. Could provide another
 // overload, find_any, find_if_any
@@ -7,17 +7,23 @@
 #include "execution_policy.h"
 #include "nlet_stride_iterator.h"
 #include "intrinsics.h"
+#include "cancellation.h"
+#include "thread_budget.h"
+#include "stripe_layout.h"
 
 namespace emu::parallel {
 namespace detail {
 
 // Serial version
-template<class Iterator, class UnaryFunction>
+template<class Iterator, class UnaryFunction, class Token = never_cancelled>
 void
 for_each(
     sequenced_policy,
-    Iterator begin, Iterator end, UnaryFunction worker
+    Iterator begin, Iterator end, UnaryFunction worker,
+    Token token = {}
 ) {
+    // The whole range is a single grain, check for cancellation once
+    if (token.is_cancelled()) { return; }
     // Forward to standard library implementation
     std::for_each(begin, end, worker);
 }
@@ -58,61 +64,82 @@ public:
     }
 };
 
-template<class Iterator, class UnaryFunction>
+template<class Iterator, class UnaryFunction, class Token = never_cancelled>
 void
 for_each(
     unroll_policy,
-    Iterator begin, Iterator end, UnaryFunction worker
+    Iterator begin, Iterator end, UnaryFunction worker,
+    Token token = {}
 ) {
+    if (token.is_cancelled()) { return; }
     unroller<Iterator, UnaryFunction>{worker}(begin, end);
 }
 
+// Runs a single grain in a spawned thread
+// The thread counts against the thread budget of its nodelet while it runs
+template<class Policy, class Iterator, class UnaryFunction,
+    class Token = never_cancelled>
+void
+for_each_grain(
+    Policy policy,
+    Iterator begin, Iterator end, UnaryFunction worker,
+    Token token = {}
+) {
+    thread_budget_guard guard;
+    detail::for_each(remove_parallel_t<Policy>(), begin, end, worker, token);
+}
+
 // Parallel version
 template<class Policy, class Iterator, class UnaryFunction,
+    class Token = never_cancelled,
     std::enable_if_t<is_parallel_policy_v<Policy>, int> = 0>
 void
 for_each(
     Policy policy,
     Iterator begin, Iterator end,
-    UnaryFunction worker
+    UnaryFunction worker,
+    Token token = {}
 ) {
     // Serial spawn over each granule
-    auto grain = Policy::grain;
+    auto grain = get_grain(policy);
     for (; begin < end; begin += grain) {
+        // Stop spawning once the loop has been cancelled
+        if (token.is_cancelled()) { break; }
         // Spawn a thread to handle each granule
         // Last iteration may be smaller if things don't divide evenly
         auto last = begin + grain <= end ? begin + grain : end;
-        cilk_spawn_at(ptr_from_iter(begin)) detail::for_each(
-            remove_parallel_t<Policy>(),
-            begin, last, worker
-        );
+        cilk_spawn_at(ptr_from_iter(begin)) detail::for_each_grain(
+            policy, begin, last, worker, token);
     }
 }
 
 // Static version
 template<class Policy, class Iterator, class UnaryFunction,
+    class Token = never_cancelled,
     std::enable_if_t<is_static_policy_v<Policy>, int> = 0>
 void
 for_each(
    Policy policy,
-   Iterator begin, Iterator end, UnaryFunction worker
+   Iterator begin, Iterator end, UnaryFunction worker,
+   Token token = {}
 ) {
     // Recalculate grain size to limit thread count
     // and forward to unlimited parallel version
     long grain = compute_fixed_grain(policy, begin, end);
     for (; begin < end; begin += grain) {
+        // Stop spawning once the loop has been cancelled
+        if (token.is_cancelled()) { break; }
         // Spawn a thread to handle each granule
         // Last iteration may be smaller if things don't divide evenly
         auto last = begin + grain <= end ? begin + grain : end;
-        cilk_spawn_at(ptr_from_iter(begin)) detail::for_each(
-            remove_parallel_t<Policy>(),
-            begin, last, worker
-        );
+        cilk_spawn_at(ptr_from_iter(begin)) detail::for_each_grain(
+            policy, begin, last, worker, token);
     }
 }
 
 // Dynamic version
-template<class Policy, class T, class UnaryOp, bool nlet_stride>
+template<class Policy, class T, class UnaryOp, bool nlet_stride,
+    class Token = never_cancelled>
 class dyn_worker
 {
 private:
@@ -124,16 +151,19 @@ private:
     T* end_;
     // Worker function to call on each item
     UnaryOp unary_op_;
+    // Checked before processing each grain
+    Token token_;
 
     void worker_thread()
     {
-        long grain = Policy::grain;
-        if (nlet_stride) { grain *= NODELETS(); }
+        long grain = get_grain(policy_);
+        if (nlet_stride) { grain = nlet_mul(grain); }
         // Atomically grab items off the list
         for (T* next = atomic_addms(next_ptr_, grain);
              next < end_;
              next = atomic_addms(next_ptr_, grain))
         {
+            if (token_.is_cancelled()) { break; }
             // Process each element
             T* last = next + grain; if (last > end_) { last = end_; }
             // May need to convert back to nlet_stride iterator
@@ -151,27 +181,31 @@ private:
      */
     void worker_thread_1()
     {
-        long increment = nlet_stride ? NODELETS() : 1;
+        long increment = nlet_stride ? nodelets() : 1;
         // Atomically grab items off the list
         for (T* next = atomic_addms(next_ptr_, increment);
              next < end_;
              next = atomic_addms(next_ptr_, increment))
         {
+            if (token_.is_cancelled()) { break; }
             // Process each element
             unary_op_(*next);
         }
     }
 
 public:
-    explicit dyn_worker(Policy policy, T** next_ptr, T* end, UnaryOp unary_op)
+    explicit dyn_worker(Policy policy, T** next_ptr, T* end, UnaryOp unary_op,
+        Token token = {})
     : policy_(policy)
     , next_ptr_(next_ptr)
     , end_(end)
     , unary_op_(unary_op)
+    , token_(token)
     {}
 
     void operator()()
     {
+        thread_budget_guard guard;
         if constexpr (Policy::grain == 1L) {
             worker_thread_1();
         } else {
@@ -182,20 +216,23 @@ public:
 
 // Assumes that the iterators are raw pointers that can be atomically advanced
 template<class Policy, class T, class UnaryFunction,
+    class Token = never_cancelled,
     std::enable_if_t<is_dynamic_policy_v<Policy>, int> = 0>
 void
 for_each(
    Policy policy,
    T* begin, T* end,
-   UnaryFunction worker)
+   UnaryFunction worker,
+   Token token = {})
 {
     // Shared pointer to the next item to process
     T* next = begin;
     // Set up the worker functor
-    dyn_worker<Policy, T, UnaryFunction, /*nlet_stride*/ false> worker_thread(
-        policy, &next, end, worker);
+    dyn_worker<Policy, T, UnaryFunction, /*nlet_stride*/ false, Token>
+    worker_thread(policy, &next, end, worker, token);
     // Create a worker thread for each execution slot
-    for (long t = 0; t < threads_per_nodelet; ++t) {
+    long num_threads = get_threads_per_nodelet(policy);
+    for (long t = 0; t < num_threads; ++t) {
         // Create and spawn the dyn_worker functor, which captures a reference
         // to the next pointer, the end pointer, and the grain size.
         cilk_spawn worker_thread();
@@ -206,21 +243,24 @@ for_each(
 // of the iterator and mulitplies stride by NODELETS() before handing off
 // to the functor
 template<class Policy, class T, class UnaryFunction,
+    class Token = never_cancelled,
     std::enable_if_t<is_dynamic_policy_v<Policy>, int> = 0>
 void
 for_each(
     Policy policy,
     nlet_stride_iterator<T*> s_begin, nlet_stride_iterator<T*> s_end,
-    UnaryFunction worker)
+    UnaryFunction worker,
+    Token token = {})
 {
     // Shared pointer to the next item to process
     T* next = &*s_begin;
     T* end = &*s_end;
     // Set up the worker functor
-    dyn_worker<Policy, T, UnaryFunction, /*nlet_stride*/ true> worker_thread(
-        policy, &next, end, worker);
+    dyn_worker<Policy, T, UnaryFunction, /*nlet_stride*/ true, Token>
+    worker_thread(policy, &next, end, worker, token);
     // Create a worker thread for each execution slot
-    for (long t = 0; t < threads_per_nodelet; ++t) {
+    long num_threads = get_threads_per_nodelet(policy);
+    for (long t = 0; t < num_threads; ++t) {
         // Create and spawn the dyn_worker functor, which captures a reference
         // to the next pointer, the end pointer, and the grain size.
         cilk_spawn worker_thread();
@@ -228,62 +268,66 @@ for_each(
 }
 
 // Serial version for striped layouts
-template<class Iterator, class UnaryFunction>
+template<class Iterator, class UnaryFunction, class Token = never_cancelled>
 void
 striped_for_each(
     sequenced_policy,
     long nlet_begin, long nlet_end,
-    Iterator begin, Iterator end, UnaryFunction worker
+    Iterator begin, Iterator end, UnaryFunction worker,
+    Token token = {}
 ) {
+    if (token.is_cancelled()) { return; }
     // Forward to standard library implementation
     // TODO process one stripe at a time to minimize migrations
     std::for_each(begin, end, worker);
 }
 
 // Serial version for striped layouts
-template<class Iterator, class UnaryFunction>
+template<class Iterator, class UnaryFunction, class Token = never_cancelled>
 void
 striped_for_each(
     unroll_policy,
     long nlet_begin, long nlet_end,
-    Iterator begin, Iterator end, UnaryFunction worker
+    Iterator begin, Iterator end, UnaryFunction worker,
+    Token token = {}
 ) {
+    if (token.is_cancelled()) { return; }
     // TODO process one stripe at a time to minimize migrations
     unroller<Iterator, UnaryFunction>{worker}(begin, end);
 }
 
 // Entry point for all parallel policies with striped layouts
-template<class Policy, class Iterator, class UnaryFunction>
+template<class Policy, class Iterator, class UnaryFunction,
+    class Token = never_cancelled>
 void
 striped_for_each(
    Policy policy,
    long nlet_begin, long nlet_end,
    Iterator begin, Iterator end,
-   UnaryFunction worker
+   UnaryFunction worker,
+   Token token = {}
 ) {
     // Recursive spawn
+    // Stop splitting once we are down to spawn_radix nodelets
+    const long nlet_radix = get_spawn_radix(policy);
     for(;;) {
         // How many nodelets do we need to spawn on?
         auto nlet_count = nlet_end - nlet_begin;
-        const long nlet_radix = 8;
         if (nlet_count <= nlet_radix) { break; }
         // Divide the nodelets in half
         long nlet_mid = nlet_begin + nlet_count / 2;
         // Spawn a thread to handle the upper half
         cilk_migrate_hint(ptr_from_iter(begin + nlet_mid));
         cilk_spawn striped_for_each(
-            policy, nlet_mid, nlet_end, begin, end, worker);
+            policy, nlet_mid, nlet_end, begin, end, worker, token);
         // Recurse over the lower half
         nlet_end = nlet_mid;
     }
 
     // Serial spawn
-    // Total number of elements
-    auto size = end - begin;
-    // Number of elements in each range
-    auto stripe_size = size / NODELETS();
-    // How many nodelets have an extra element?
-    auto stripe_remainder = size % NODELETS();
+    // Number of elements on each nodelet
+    // Stripes are numbered relative to begin, which may be on any nodelet
+    stripe_layout layout(end - begin);
     // For each nodelet in my subrange...
     for (long nlet = nlet_begin; nlet < nlet_end; ++nlet) {
         // Advance to the first element on the nth nodelet and convert
@@ -291,13 +335,11 @@ striped_for_each(
         auto stripe_begin = nlet_stride_iterator<Iterator>(begin + nlet);
         // Now that the pointer has stride NODELETS(), we are addressing
         // only the elements on the nth nodelet
-        auto stripe_end = stripe_begin + stripe_size;
-        // Distribute remainder among first few nodelets
-        if (nlet < stripe_remainder) { stripe_end += 1; }
+        auto stripe_end = stripe_begin + layout.count(nlet);
         // Spawn a thread to handle each stripe
         cilk_migrate_hint(ptr_from_iter(stripe_begin));
         cilk_spawn detail::for_each(
-            policy, stripe_begin, stripe_end, worker);
+            policy, stripe_begin, stripe_end, worker, token);
     }
 }
 
@@ -315,13 +357,67 @@ for_each(
 ){
    if (end-begin == 0) {
        return;
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       for_each(remove_parallel_t<ExecutionPolicy>(), begin, end, worker);
    } else if (is_striped(begin)) {
-       detail::striped_for_each(policy, 0, NODELETS(), begin, end, worker);
+       detail::striped_for_each(policy, 0, nodelets(), begin, end, worker);
    } else {
        detail::for_each(policy, begin, end, worker);
    }
 }
 
+// Cancellable version: worker threads stop picking up new grains once the
+// token has been cancelled
+template<class ExecutionPolicy, class Iterator, class UnaryFunction,
+   // Disable if first argument is not an execution policy
+   std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+for_each(
+   ExecutionPolicy policy,
+   Iterator begin, Iterator end, UnaryFunction worker,
+   cancellation_ref token
+){
+   if (end-begin == 0) {
+       return;
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       for_each(remove_parallel_t<ExecutionPolicy>(),
+           begin, end, worker, token);
+   } else if (is_striped(begin)) {
+       detail::striped_for_each(
+           policy, 0, nodelets(), begin, end, worker, token);
+   } else {
+       detail::for_each(policy, begin, end, worker, token);
+   }
+}
+
+// Default policy: pick the schedule from the runtime configuration
+// Dynamic schedule requires a raw pointer, fall back to static otherwise
+template<class Iterator, class UnaryFunction>
+void
+for_each(
+   default_policy_t,
+   Iterator begin, Iterator end, UnaryFunction worker
+){
+   visit_default_policy<std::is_pointer_v<Iterator>>([&](auto policy) {
+       for_each(policy, begin, end, worker);
+   });
+}
+
+template<class Iterator, class UnaryFunction>
+void
+for_each(
+   default_policy_t,
+   Iterator begin, Iterator end, UnaryFunction worker,
+   cancellation_ref token
+){
+   visit_default_policy<std::is_pointer_v<Iterator>>([&](auto policy) {
+       for_each(policy, begin, end, worker, token);
+   });
+}
+
 template<class Iterator, class UnaryFunction>
 void
 for_each(Iterator begin, Iterator end, UnaryFunction worker
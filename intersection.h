@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "execution_policy.h"
+#include "out_of_memory.h"
+
+/*
+ * Kernels for intersecting two sorted ranges, i.e. the neighbor lists of two
+ * vertices in triangle counting. Each kernel calls visit(x) for every common
+ * element; the count and copy variants are built on top of them.
+ *
+ * Duplicates are handled like std::set_intersection: an element that appears
+ * m times in one range and n times in the other is visited min(m, n) times.
+ * intersect_bitmap is the exception, see below.
+ */
+
+namespace emu {
+
+// Algorithm used to intersect two sorted ranges
+enum class intersect_method
+{
+    // Pick merge or gallop based on the ratio of the sizes
+    automatic,
+    // Linear merge, O(m + n)
+    merge,
+    // Exponential search of the longer range, O(m log(n / m))
+    gallop,
+};
+
+namespace detail {
+
+// Galloping uses fewer comparisons than a merge when one range is this many
+// times longer than the other
+constexpr long gallop_ratio = 32;
+
+template<class Iterator, class T>
+Iterator
+gallop_lower_bound(Iterator first, Iterator last, const T& x)
+{
+    // Double the step until we pass x, then binary search the last step
+    long step = 1;
+    Iterator lo = first;
+    while (last - lo > step && lo[step] < x) {
+        lo += step;
+        step *= 2;
+    }
+    Iterator hi = last - lo > step ? lo + step + 1 : last;
+    return std::lower_bound(lo, hi, x);
+}
+
+template<class AIt, class BIt, class Visitor>
+void
+intersect_merge(AIt a_first, AIt a_last, BIt b_first, BIt b_last,
+    Visitor visit)
+{
+    while (a_first != a_last && b_first != b_last) {
+        if (*a_first < *b_first) {
+            ++a_first;
+        } else if (*b_first < *a_first) {
+            ++b_first;
+        } else {
+            visit(*a_first);
+            ++a_first;
+            ++b_first;
+        }
+    }
+}
+
+// Searches for each element of the short range in the long range
+template<class ShortIt, class LongIt, class Visitor>
+void
+intersect_gallop(ShortIt s_first, ShortIt s_last, LongIt l_first, LongIt l_last,
+    Visitor visit)
+{
+    for (; s_first != s_last && l_first != l_last; ++s_first) {
+        l_first = gallop_lower_bound(l_first, l_last, *s_first);
+        if (l_first != l_last && !(*s_first < *l_first)) {
+            visit(*s_first);
+            ++l_first;
+        }
+    }
+}
+
+} // end namespace detail
+
+/**
+ * Calls visit(x) for each element x common to the sorted ranges
+ * [a_first, a_last) and [b_first, b_last), in sorted order.
+ */
+template<class AIt, class BIt, class Visitor>
+void
+intersect(AIt a_first, AIt a_last, BIt b_first, BIt b_last, Visitor visit,
+    intersect_method method = intersect_method::automatic)
+{
+    long m = std::distance(a_first, a_last);
+    long n = std::distance(b_first, b_last);
+    if (m == 0 || n == 0) { return; }
+    if (method == intersect_method::automatic) {
+        method = std::max(m, n) >= detail::gallop_ratio * std::min(m, n)
+            ? intersect_method::gallop
+            : intersect_method::merge;
+    }
+    if (method == intersect_method::merge) {
+        detail::intersect_merge(a_first, a_last, b_first, b_last, visit);
+    } else if (m <= n) {
+        detail::intersect_gallop(a_first, a_last, b_first, b_last, visit);
+    } else {
+        detail::intersect_gallop(b_first, b_last, a_first, a_last, visit);
+    }
+}
+
+// Returns the number of elements common to two sorted ranges
+template<class AIt, class BIt>
+long
+intersect_count(AIt a_first, AIt a_last, BIt b_first, BIt b_last,
+    intersect_method method = intersect_method::automatic)
+{
+    long count = 0;
+    intersect(a_first, a_last, b_first, b_last,
+        [&](const auto&) { ++count; }, method);
+    return count;
+}
+
+/**
+ * Copies the elements common to two sorted ranges to out
+ * @return End of the output range
+ */
+template<class AIt, class BIt, class OutputIt>
+OutputIt
+intersect_copy(AIt a_first, AIt a_last, BIt b_first, BIt b_last, OutputIt out,
+    intersect_method method = intersect_method::automatic)
+{
+    intersect(a_first, a_last, b_first, b_last,
+        [&](const auto& x) { *out++ = x; }, method);
+    return out;
+}
+
+/**
+ * Bitmap over the elements of one sorted range of integers, for intersecting
+ * a hub's neighbor list with many shorter lists. Build it once on the hub's
+ * nodelet, then each intersection is one bit test per element of the other
+ * list, without searching the hub's list at all.
+ *
+ * Only covers the values between the first and last element of the range, so
+ * the size is (back - front) / 64 words.
+ *
+ * Unlike the other kernels, the bitmap is a set: duplicates in the range it
+ * was built from are collapsed, and every element of the other list that is
+ * in the bitmap is visited, duplicates included. The results match
+ * std::set_intersection when the other list has no duplicates.
+ */
+template<class T>
+class intersect_bitmap
+{
+    static_assert(std::is_integral_v<T>, "Bitmap requires integer elements");
+private:
+    T lo_;
+    T hi_;
+    unsigned long* words_;
+
+    static long
+    num_words(T lo, T hi) { return (static_cast<long>(hi - lo) >> 6) + 1; }
+
+public:
+    /**
+     * Constructs a bitmap from the sorted range [first, last)
+     * @param hint Pointer to memory on the nodelet where the bitmap is used,
+     * defaults to the first element of the range
+     */
+    template<class Iterator>
+    intersect_bitmap(Iterator first, Iterator last, void* hint = nullptr)
+    // Empty range: lo > hi, so nothing is contained
+    : lo_(first != last ? *first : T{1})
+    , hi_(first != last ? *std::prev(last) : T{0})
+    {
+        if (!hint) { hint = ptr_from_iter(first); }
+        long n = std::max(num_words(lo_, hi_), 1L);
+        words_ = reinterpret_cast<unsigned long*>(
+            mw_localmalloc(sizeof(unsigned long) * n, hint));
+        if (!words_) { EMU_OUT_OF_MEMORY(sizeof(unsigned long) * n); }
+        std::fill(words_, words_ + n, 0UL);
+        for (; first != last; ++first) {
+            long bit = static_cast<long>(*first - lo_);
+            words_[bit >> 6] |= 1UL << (bit & 63);
+        }
+    }
+
+    intersect_bitmap(const intersect_bitmap&) = delete;
+    intersect_bitmap& operator=(const intersect_bitmap&) = delete;
+
+    ~intersect_bitmap() { mw_localfree(words_); }
+
+    bool contains(T x) const
+    {
+        if (x < lo_ || hi_ < x) { return false; }
+        long bit = static_cast<long>(x - lo_);
+        return (words_[bit >> 6] >> (bit & 63)) & 1;
+    }
+
+    // Calls visit(x) for each element x of [first, last) in the bitmap
+    // Duplicates in [first, last) are each visited
+    template<class Iterator, class Visitor>
+    void intersect(Iterator first, Iterator last, Visitor visit) const
+    {
+        for (; first != last; ++first) {
+            if (contains(*first)) { visit(*first); }
+        }
+    }
+
+    // Returns the number of elements of [first, last) in the bitmap
+    template<class Iterator>
+    long intersect_count(Iterator first, Iterator last) const
+    {
+        long count = 0;
+        intersect(first, last, [&](const auto&) { ++count; });
+        return count;
+    }
+};
+
+namespace detail {
+
+// Copies the short range next to the long one, then intersects locally
+template<class ShortIt, class LongIt>
+long
+intersect_count_local(ShortIt s_first, ShortIt s_last,
+    LongIt l_first, LongIt l_last, intersect_method method)
+{
+    using T = typename std::iterator_traits<ShortIt>::value_type;
+    long m = std::distance(s_first, s_last);
+    T* scratch = reinterpret_cast<T*>(
+        mw_localmalloc(sizeof(T) * m, ptr_from_iter(l_first)));
+    if (!scratch) { EMU_OUT_OF_MEMORY(sizeof(T) * m); }
+    std::copy(s_first, s_last, scratch);
+    long count = intersect_count(scratch, scratch + m, l_first, l_last, method);
+    mw_localfree(scratch);
+    return count;
+}
+
+} // end namespace detail
+
+/**
+ * Counts the elements common to two sorted ranges on the nodelet that holds
+ * the longer one. The shorter range is copied there in bulk first, so the
+ * intersection itself causes no migrations. Each range must be stored on a
+ * single nodelet (i.e. a neighbor list allocated with mw_localmalloc).
+ */
+template<class AIt, class BIt>
+long
+intersect_count_remote(AIt a_first, AIt a_last, BIt b_first, BIt b_last,
+    intersect_method method = intersect_method::automatic)
+{
+    long m = std::distance(a_first, a_last);
+    long n = std::distance(b_first, b_last);
+    if (m == 0 || n == 0) { return 0; }
+    long count;
+    if (m <= n) {
+        cilk_migrate_hint(ptr_from_iter(b_first));
+        count = cilk_spawn detail::intersect_count_local(
+            a_first, a_last, b_first, b_last, method);
+    } else {
+        cilk_migrate_hint(ptr_from_iter(a_first));
+        count = cilk_spawn detail::intersect_count_local(
+            b_first, b_last, a_first, a_last, method);
+    }
+    cilk_sync;
+    return count;
+}
+
+} // end namespace emu
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstring>
 #include <functional>
 #include <emu_c_utils/emu_c_utils.h>
 
@@ -114,5 +115,44 @@ remote_min(volatile unsigned long * ptr, unsigned long value) {
         static_cast<long>(value));
 }
 
+// Atomic min/max on 64-bit int, returns the previous value
+inline long
+atomic_max(volatile long * ptr, long value) {
+    return ATOMIC_MAXMS(ptr, value);
+}
+inline long
+atomic_min(volatile long * ptr, long value) {
+    return ATOMIC_MINMS(ptr, value);
+}
+
+// Atomically adds value to *ptr, using a remote add for integers
+inline void
+atomic_accumulate(long* ptr, long value)
+{
+    remote_add(ptr, value);
+}
+
+// No remote add for floating point, retry with compare-and-swap
+// Compares bit patterns rather than values, so the loop still terminates when
+// the target holds NaN and doesn't mistake -0.0 for +0.0
+template<class T>
+void
+atomic_accumulate(T* ptr, T value)
+{
+    static_assert(sizeof(T) == sizeof(long), "CAS supported only for 64-bit types");
+    auto word_ptr = reinterpret_cast<long*>(ptr);
+    long old_word = *word_ptr;
+    for (;;) {
+        T old_value;
+        std::memcpy(&old_value, &old_word, sizeof(T));
+        T new_value = old_value + value;
+        long new_word;
+        std::memcpy(&new_word, &new_value, sizeof(T));
+        long prev = atomic_cas(word_ptr, old_word, new_word);
+        if (prev == old_word) { break; }
+        old_word = prev;
+    }
+}
+
 //TODO implement all remotes/atomics
 };
\ No newline at end of file
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cilk/cilk.h>
+#include "execution_policy.h"
+#include "for_each.h"
+
+namespace emu::parallel {
+namespace detail {
+
+// Applies worker(outer, inner) to each item in the inner range
+template<class Policy, class Outer, class Iterator, class BinaryFunction>
+void
+inner_for_each(
+    Policy policy, Outer& outer,
+    Iterator begin, Iterator end,
+    BinaryFunction worker
+) {
+    detail::for_each(policy, begin, end,
+        [&](auto& inner) { worker(outer, inner); });
+}
+
+template<class Policy, class Outer, class Iterator, class BinaryFunction>
+void
+inner_spawn_tree(Policy policy, long grain, Outer& outer,
+    Iterator begin, Iterator end, BinaryFunction worker);
+
+// Runs a subtree of inner_spawn_tree in a spawned thread that counts against
+// the budget
+template<class Policy, class Outer, class Iterator, class BinaryFunction>
+void
+inner_subtree(Policy policy, long grain, Outer& outer,
+    Iterator begin, Iterator end, BinaryFunction worker)
+{
+    thread_budget_guard guard;
+    inner_spawn_tree(policy, grain, outer, begin, end, worker);
+}
+
+/**
+ * Splits a long inner range in half on a grain boundary, spawning a thread
+ * for the lower half next to its data and continuing with the upper half,
+ * until one grain is left. Threads spawn threads, so a high degree item
+ * doesn't wait on one thread to spawn all of its grains.
+ */
+template<class Policy, class Outer, class Iterator, class BinaryFunction>
+void
+inner_spawn_tree(Policy policy, long grain, Outer& outer,
+    Iterator begin, Iterator end, BinaryFunction worker)
+{
+    for (;;) {
+        long n = end - begin;
+        if (n <= grain) { break; }
+        auto mid = begin + ((n + grain - 1) / grain / 2) * grain;
+        cilk_spawn_at(ptr_from_iter(begin)) inner_subtree(
+            policy, grain, outer, begin, mid, worker);
+        begin = mid;
+    }
+    inner_for_each(policy, outer, begin, end, worker);
+}
+
+// Grain size for splitting inner ranges. Dynamic policies use their grain
+// as the number of outer items to claim at a time (often 1), which is far
+// too small to split an inner range with.
+template<class Policy>
+long
+inner_grain(Policy policy)
+{
+    if constexpr (!is_dynamic_policy_v<Policy>) {
+        return get_grain(policy);
+    } else if constexpr (is_runtime_policy_v<Policy>) {
+        return get_runtime_config().grain;
+    } else {
+        return default_grain;
+    }
+}
+
+/**
+ * Worker functor for the outer loop of nested_for_each.
+ *
+ * Items with a short inner range are processed inline by the thread that
+ * picked up the outer item. Longer inner ranges are split into grains with a
+ * tree of spawns, each on the nodelet that holds the inner data.
+ */
+template<class Policy, class InnerRange, class BinaryFunction>
+class flattened_worker
+{
+private:
+    // Execution policy of my parent thread
+    Policy policy_;
+    // Inner ranges longer than this are split across threads
+    long grain_;
+    // Returns the inner range (a begin/end pair) for an outer item
+    InnerRange inner_range_;
+    // Worker function to call on each (outer, inner) pair
+    BinaryFunction worker_;
+public:
+    flattened_worker(Policy policy, InnerRange inner_range,
+        BinaryFunction worker)
+    : policy_(policy)
+    , grain_(inner_grain(policy))
+    , inner_range_(inner_range)
+    , worker_(worker)
+    {}
+
+    template<class Outer>
+    void operator()(Outer& outer)
+    {
+        auto [begin, end] = inner_range_(outer);
+        if (end - begin <= grain_ || thread_budget_exhausted(policy_)) {
+            // Low degree, or no threads to spare: no need to spawn
+            inner_for_each(remove_parallel_t<Policy>(),
+                outer, begin, end, worker_);
+            return;
+        }
+        // High degree: spawn a tree of threads, one per grain, near the data
+        inner_spawn_tree(remove_parallel_t<Policy>(),
+            grain_, outer, begin, end, worker_);
+    }
+};
+
+} // end namespace detail
+
+/**
+ * Flattened two-level loop, i.e. iterating over each edge of each vertex.
+ * Calls worker(outer, inner) for each outer item in [begin, end) and each
+ * inner item in inner_range(outer).
+ *
+ * The outer loop is scheduled according to the policy. Inner ranges that
+ * are no longer than the grain size are processed inline, longer ones are
+ * split into grains that are spawned on the nodelet holding the inner data.
+ * Dynamic policies split inner ranges with the default (or runtime) grain
+ * size rather than their own, which only sets how many outer items a thread
+ * claims at a time.
+ * This avoids a thread per outer item for low degree items, while still
+ * balancing the load for high degree items.
+ *
+ * @param inner_range Function that returns a begin/end pair of iterators
+ * (i.e. std::pair) for the inner range of an outer item
+ */
+template<class ExecutionPolicy, class Iterator, class InnerRange,
+   class BinaryFunction,
+   // Disable if first argument is not an execution policy
+   std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+nested_for_each(
+   ExecutionPolicy policy,
+   Iterator begin, Iterator end,
+   InnerRange inner_range, BinaryFunction worker
+){
+   // Qualified call, the functor type would pull in detail::for_each via ADL
+   emu::parallel::for_each(policy, begin, end,
+       detail::flattened_worker<ExecutionPolicy, InnerRange, BinaryFunction>(
+           policy, inner_range, worker));
+}
+
+// Serial policies: plain nested loops
+template<class Iterator, class InnerRange, class BinaryFunction>
+void
+nested_for_each(
+   sequenced_policy policy,
+   Iterator begin, Iterator end,
+   InnerRange inner_range, BinaryFunction worker
+){
+   emu::parallel::for_each(policy, begin, end, [&](auto& outer) {
+       auto [inner_begin, inner_end] = inner_range(outer);
+       detail::inner_for_each(policy, outer, inner_begin, inner_end, worker);
+   });
+}
+
+template<class Iterator, class InnerRange, class BinaryFunction>
+void
+nested_for_each(
+   unroll_policy policy,
+   Iterator begin, Iterator end,
+   InnerRange inner_range, BinaryFunction worker
+){
+   emu::parallel::for_each(seq, begin, end, [&](auto& outer) {
+       auto [inner_begin, inner_end] = inner_range(outer);
+       detail::inner_for_each(policy, outer, inner_begin, inner_end, worker);
+   });
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class Iterator, class InnerRange, class BinaryFunction>
+void
+nested_for_each(
+   default_policy_t,
+   Iterator begin, Iterator end,
+   InnerRange inner_range, BinaryFunction worker
+){
+   visit_default_policy<std::is_pointer_v<Iterator>>([&](auto policy) {
+       nested_for_each(policy, begin, end, inner_range, worker);
+   });
+}
+
+template<class Iterator, class InnerRange, class BinaryFunction>
+void
+nested_for_each(
+   Iterator begin, Iterator end,
+   InnerRange inner_range, BinaryFunction worker
+){
+   nested_for_each(emu::default_policy, begin, end, inner_range, worker);
+}
+
+} // end namespace emu::parallel
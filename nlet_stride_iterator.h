@@ -3,6 +3,7 @@
 #include <cassert>
 #include <iterator>
 #include "intrinsics.h"
+#include "nodelets.h"
 
 namespace emu {
 
@@ -42,7 +43,7 @@ public:
     // All the other operators are boilerplate.
     self_type& operator+=(difference_type n)
     {
-        it += n * NODELETS();
+        it += nlet_mul(n);
         return *this;
     }
     self_type& operator-=(difference_type n)    { return operator+=(-n); }
@@ -100,7 +101,7 @@ public:
     friend difference_type
     operator- (const self_type& lhs, const self_type& rhs)
     {
-        return (lhs.it - rhs.it) / NODELETS();
+        return nlet_div(lhs.it - rhs.it);
     }
 
     // Provide overloads for atomic increment
@@ -108,7 +109,7 @@ public:
     friend nlet_stride_iterator
     atomic_addms(nlet_stride_iterator* iter, ptrdiff_t value)
     {
-        value *= NODELETS();
+        value = nlet_mul(value);
         return nlet_stride_iterator(emu::atomic_addms(&iter->it, value));
     }
 
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <emu_c_utils/emu_c_utils.h>
+
+/*
+ * Number of nodelets, for use in stripe index arithmetic.
+ *
+ * By default this is NODELETS(), which is queried at run time. Define
+ * EMU_CXX_NODELETS to the number of nodelets in the target system to make it
+ * a compile-time constant instead. Then division and modulo by the nodelet
+ * count become shifts and masks when it is a power of two, and loops over
+ * nodelets have a constant trip count that the compiler can unroll.
+ * The library checks that the constant matches NODELETS() in
+ * init_runtime_config().
+ */
+
+namespace emu {
+
+#ifdef EMU_CXX_NODELETS
+static_assert(EMU_CXX_NODELETS > 0, "EMU_CXX_NODELETS must be positive");
+
+constexpr long
+nodelets() { return EMU_CXX_NODELETS; }
+
+// True if the nodelet count is known at compile time
+constexpr bool nodelets_are_constant = true;
+#else
+inline long
+nodelets() { return NODELETS(); }
+
+constexpr bool nodelets_are_constant = false;
+#endif
+
+namespace detail {
+
+#ifdef EMU_CXX_NODELETS
+constexpr bool nodelets_pow2 = (EMU_CXX_NODELETS & (EMU_CXX_NODELETS - 1)) == 0;
+#else
+constexpr bool nodelets_pow2 = false;
+#endif
+
+} // end namespace detail
+
+// Multiplies by the number of nodelets
+// With a constant nodelet count, the compiler turns this into a shift
+inline long
+nlet_mul(long i)
+{
+    return i * nodelets();
+}
+
+// Divides by the number of nodelets, rounding toward zero like operator/
+// With a constant nodelet count, the compiler turns this into a shift (plus a
+// sign fixup) or a multiply
+inline long
+nlet_div(long i)
+{
+    return i / nodelets();
+}
+
+// Remainder after dividing by the number of nodelets
+// Must be non-negative
+inline long
+nlet_mod(long i)
+{
+    if constexpr (detail::nodelets_pow2) {
+        return i & (nodelets() - 1);
+    } else {
+        return i % nodelets();
+    }
+}
+
+} // end namespace emu
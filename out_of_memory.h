@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdio>
+#include <exception>
 
 #define EMU_OUT_OF_MEMORY(BYTES) emu::out_of_memory(__PRETTY_FUNCTION__, BYTES)
 
@@ -0,0 +1,521 @@
+#pragma once
+
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <emu_c_utils/emu_c_utils.h>
+#include <cilk/cilk.h>
+
+#include "replicated.h"
+#include "intrinsics.h"
+#include "nodelets.h"
+#include "striped_array.h"
+#include "execution_policy.h"
+#include "for_each.h"
+#include "reduce.h"
+
+namespace emu {
+
+namespace detail {
+
+// Splits a 64-bit word into two 32-bit elements
+template<class T>
+struct packed_pair
+{
+    T halves[2];
+
+    static packed_pair
+    from_word(long word)
+    {
+        packed_pair p;
+        std::memcpy(p.halves, &word, sizeof(word));
+        return p;
+    }
+
+    long
+    to_word() const
+    {
+        long word;
+        std::memcpy(&word, halves, sizeof(word));
+        return word;
+    }
+};
+
+} // end namespace detail
+
+/**
+ * Proxy reference to one element of a packed_array. Reads and writes touch
+ * only the 32-bit half of the word that holds the element, so plain writes to
+ * the two elements of a word from different threads do not conflict.
+ */
+template<class T>
+class packed_ref
+{
+private:
+    long* word_;
+    long half_;
+public:
+    packed_ref(long* word, long half) : word_(word), half_(half) {}
+    // Copies refer to the same element; assignment writes through instead
+    packed_ref(const packed_ref&) = default;
+
+    operator T() const
+    {
+        T x;
+        std::memcpy(&x, reinterpret_cast<char*>(word_) + half_ * sizeof(T),
+            sizeof(T));
+        return x;
+    }
+
+    packed_ref& operator=(T x)
+    {
+        std::memcpy(reinterpret_cast<char*>(word_) + half_ * sizeof(T), &x,
+            sizeof(T));
+        return *this;
+    }
+
+    packed_ref& operator=(const packed_ref& other)
+    {
+        return *this = static_cast<T>(other);
+    }
+
+    // Pointer to the 64-bit word that holds this element and its partner
+    long* word() const { return word_; }
+    // Position within the word, 0 or 1
+    long half() const { return half_; }
+};
+
+/**
+ * Iterator over a packed_array. Element i is half (i % 2) of word (i / 2).
+ *
+ * Stepping from one word to the next advances the word pointer by the stride,
+ * which is 1 for the whole array or nodelets() for the elements on a single
+ * nodelet.
+ *
+ * @tparam T Element type, may be const
+ */
+template<class T>
+class packed_iterator
+{
+public:
+    using self_type = packed_iterator;
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = std::remove_const_t<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = std::conditional_t<std::is_const_v<T>,
+        value_type, packed_ref<value_type>>;
+private:
+    // Pointer to the current word, must be first for ptr_from_iter()
+    long* word_;
+    // Position within the current word, 0 or 1
+    long half_;
+    // Distance between consecutive words
+    long stride_;
+public:
+    packed_iterator() : word_(nullptr), half_(0), stride_(1) {}
+    packed_iterator(const long* word, long half, long stride = 1)
+    : word_(const_cast<long*>(word)), half_(half), stride_(stride) {}
+
+    // Conversion to const iterator
+    operator packed_iterator<const T>() const
+    {
+        return packed_iterator<const T>(word_, half_, stride_);
+    }
+
+    long* word() const { return word_; }
+    long half() const { return half_; }
+    long stride() const { return stride_; }
+
+    reference operator*() const
+    {
+        packed_ref<value_type> ref(word_, half_);
+        if constexpr (std::is_const_v<T>) {
+            return static_cast<value_type>(ref);
+        } else {
+            return ref;
+        }
+    }
+    reference operator[](difference_type n) const { return *(*this + n); }
+
+    self_type& operator+=(difference_type n)
+    {
+        long i = half_ + n;
+        // Round towards negative infinity
+        long words = i >= 0 ? i / 2 : -((1 - i) / 2);
+        word_ += words * stride_;
+        half_ = i - words * 2;
+        return *this;
+    }
+    self_type& operator-=(difference_type n)    { return operator+=(-n); }
+    self_type& operator++()                     { return operator+=(+1); }
+    self_type& operator--()                     { return operator+=(-1); }
+    self_type  operator++(int)            { self_type tmp = *this; this->operator++(); return tmp; }
+    self_type  operator--(int)            { self_type tmp = *this; this->operator--(); return tmp; }
+
+    friend difference_type
+    operator-(const self_type& lhs, const self_type& rhs)
+    {
+        return (lhs.word_ - rhs.word_) / lhs.stride_ * 2
+            + (lhs.half_ - rhs.half_);
+    }
+
+    friend self_type
+    operator+(self_type iter, difference_type n) { return iter += n; }
+    friend self_type
+    operator+(difference_type n, self_type iter) { return iter += n; }
+    friend self_type
+    operator-(self_type iter, difference_type n) { return iter -= n; }
+
+    // Compare iterators
+    friend bool
+    operator==(const self_type& lhs, const self_type& rhs)
+    {
+        return lhs.word_ == rhs.word_ && lhs.half_ == rhs.half_;
+    }
+    friend bool
+    operator!=(const self_type& lhs, const self_type& rhs) { return !(lhs == rhs); }
+    friend bool
+    operator< (const self_type& lhs, const self_type& rhs) { return lhs - rhs < 0; }
+    friend bool
+    operator> (const self_type& lhs, const self_type& rhs) { return rhs < lhs; }
+    friend bool
+    operator<=(const self_type& lhs, const self_type& rhs) { return !(rhs < lhs); }
+    friend bool
+    operator>=(const self_type& lhs, const self_type& rhs) { return !(lhs < rhs); }
+};
+
+/**
+ * Striped array of 32-bit values, packed two to a 64-bit word. Uses half the
+ * memory and bandwidth of a striped_array<long> for fields like labels, small
+ * degrees and float weights.
+ *
+ * Word w is stored on nodelet (w % nodelets()), so elements 2w and 2w+1 are
+ * always on the same nodelet. Elements are accessed through packed_ref
+ * proxies; use the atomic helpers below for concurrent updates.
+ *
+ * @tparam T Element type. Must be a trivially copyable 32-bit type.
+ */
+template<class T>
+class packed_array
+{
+    static_assert(sizeof(T) == 4 && std::is_trivially_copyable_v<T>,
+        "packed_array can only hold 32-bit data types");
+private:
+    repl<long> n_;
+    striped_array<long> words_;
+
+public:
+    typedef T value_type;
+    typedef packed_iterator<T> iterator;
+    typedef packed_iterator<const T> const_iterator;
+
+    // Default constructor
+    packed_array() : n_(0) {}
+
+    /**
+     * Constructs a packed_array<T>
+     * @param n Number of elements
+     */
+    explicit packed_array(long n)
+    : n_(n)
+    , words_((n + 1) / 2)
+    {}
+
+    friend void
+    swap(packed_array& first, packed_array& second)
+    {
+        using std::swap;
+        swap(first.n_, second.n_);
+        swap(first.words_, second.words_);
+    }
+
+    // Copy constructor
+    packed_array(const packed_array & other) = delete;
+
+    // Assignment operator (using copy-and-swap idiom)
+    packed_array& operator= (packed_array other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+
+    // Move constructor (using copy-and-swap idiom)
+    packed_array(packed_array&& other) noexcept : packed_array()
+    {
+        swap(*this, other);
+    }
+
+    // Shallow copy constructor (used for repl<T>)
+    packed_array(const packed_array& other, shallow_copy)
+    : n_(other.n_), words_(other.words_, shallow_copy()) {}
+
+    iterator begin ()               { return iterator(words_.data(), 0); }
+    iterator end ()                 { return begin() + n_; }
+    const_iterator begin () const   { return const_iterator(words_.data(), 0); }
+    const_iterator end () const     { return begin() + n_; }
+    const_iterator cbegin () const  { return begin(); }
+    const_iterator cend () const    { return end(); }
+
+    packed_ref<T>
+    operator[] (long i)
+    {
+        return packed_ref<T>(words_.data() + i / 2, i % 2);
+    }
+
+    T
+    operator[] (long i) const
+    {
+        return const_cast<packed_array&>(*this)[i];
+    }
+
+    long size() const { return n_; }
+
+    // Underlying striped words, two elements per word
+    long* data() { return words_.data(); }
+    const long* data() const { return words_.data(); }
+    long num_words() const { return words_.size(); }
+};
+
+/**
+ * Atomically replaces the element with f(old) and returns the old value.
+ * Uses compare-and-swap on the whole word, so it is safe alongside atomic
+ * updates to the other element of the pair.
+ */
+template<class T, class Function>
+T
+atomic_update(packed_ref<T> ref, Function f)
+{
+    using pair = detail::packed_pair<T>;
+    long old_word = *ref.word();
+    for (;;) {
+        pair p = pair::from_word(old_word);
+        T old_value = p.halves[ref.half()];
+        p.halves[ref.half()] = f(old_value);
+        long prev = atomic_cas(ref.word(), old_word, p.to_word());
+        if (prev == old_word) { return old_value; }
+        old_word = prev;
+    }
+}
+
+// Atomically adds delta to the element and returns the old value
+template<class T>
+T
+atomic_add(packed_ref<T> ref, T delta)
+{
+    return atomic_update(ref, [=](T x) { return static_cast<T>(x + delta); });
+}
+
+/**
+ * Atomically updates both elements of the word that holds ref (elements 2w
+ * and 2w+1) with a single compare-and-swap. f takes the old pair and returns
+ * the new pair, i.e. to update a (value, count) pair together.
+ * @return The old pair
+ */
+template<class T, class Function>
+std::pair<T, T>
+atomic_update_pair(packed_ref<T> ref, Function f)
+{
+    using pair = detail::packed_pair<T>;
+    long old_word = *ref.word();
+    for (;;) {
+        pair p = pair::from_word(old_word);
+        std::pair<T, T> old_values(p.halves[0], p.halves[1]);
+        std::pair<T, T> new_values = f(old_values);
+        p.halves[0] = new_values.first;
+        p.halves[1] = new_values.second;
+        long prev = atomic_cas(ref.word(), old_word, p.to_word());
+        if (prev == old_word) { return old_values; }
+        old_word = prev;
+    }
+}
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+// Packed stripes are already divided evenly and can't be advanced atomically
+// like a raw pointer, so dynamic policies use the static schedule instead
+template<class Policy> struct packed_schedule { using type = Policy; };
+template<long Grain> struct packed_schedule<dynamic_policy<Grain>> {
+    using type = static_policy<Grain>; };
+template<long Grain> struct packed_schedule<dynamic_unroll_policy<Grain>> {
+    using type = static_unroll_policy<Grain>; };
+template<class Policy>
+using packed_schedule_t = typename packed_schedule<Policy>::type;
+
+// The local reductions have no unrolled variant
+template<class Policy> struct packed_reduce_schedule {
+    using type = packed_schedule_t<Policy>; };
+template<> struct packed_reduce_schedule<unroll_policy> {
+    using type = sequenced_policy; };
+template<long Grain> struct packed_reduce_schedule<parallel_unroll_policy<Grain>> {
+    using type = parallel_policy<Grain>; };
+template<long Grain> struct packed_reduce_schedule<static_unroll_policy<Grain>> {
+    using type = static_policy<Grain>; };
+template<long Grain> struct packed_reduce_schedule<dynamic_unroll_policy<Grain>> {
+    using type = static_policy<Grain>; };
+template<class Policy>
+using packed_reduce_schedule_t = typename packed_reduce_schedule<Policy>::type;
+
+/**
+ * Returns the elements of [begin, end) on the kth nodelet, counting from the
+ * nodelet that holds begin, as a pair of iterators with stride nodelets().
+ */
+template<class T>
+std::pair<packed_iterator<T>, packed_iterator<T>>
+packed_stripe(packed_iterator<T> begin, packed_iterator<T> end, long k)
+{
+    // Element indices relative to the first word of the range
+    long lo = begin.half();
+    long hi = lo + (end - begin);
+    long num_words = (hi + 1) / 2;
+    long count = 0;
+    if (k < num_words) {
+        count = 2 * ((num_words - 1 - k) / nodelets() + 1);
+        // Clip partial words at either end of the range
+        if (k == 0) { count -= lo; }
+        if (nlet_mod(num_words - 1) == k) { count -= hi % 2; }
+    }
+    packed_iterator<T> stripe_begin(begin.word() + k,
+        k == 0 ? lo : 0, nodelets());
+    return {stripe_begin, stripe_begin + count};
+}
+
+} // end namespace detail
+
+/**
+ * for_each over a packed_array. The worker is called with a packed_ref<T>
+ * proxy (or a T for a const range).
+ *
+ * Spawns a thread on each nodelet to handle its stripe of words, so each
+ * grain touches only local memory.
+ */
+template<class Policy, class T, class UnaryFunction,
+   // Disable if first argument is not an execution policy
+   // The default policy is resolved by the overload below
+   std::enable_if_t<is_execution_policy_v<Policy>
+       && !std::is_same_v<Policy, default_policy_t>, int> = 0
+>
+void
+for_each(
+   Policy policy,
+   packed_iterator<T> begin, packed_iterator<T> end,
+   UnaryFunction worker
+){
+   using serial_policy = remove_parallel_t<Policy>;
+   if (end - begin == 0) {
+       return;
+   } else if constexpr (std::is_same_v<serial_policy, Policy>) {
+       detail::for_each(policy, begin, end, worker);
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       for_each(serial_policy(), begin, end, worker);
+   } else {
+       detail::packed_schedule_t<Policy> local_policy;
+       for (long k = 0; k < nodelets(); ++k) {
+           auto stripe = detail::packed_stripe(begin, end, k);
+           if (stripe.first == stripe.second) { continue; }
+           cilk_migrate_hint(stripe.first.word());
+           cilk_spawn detail::for_each(
+               local_policy, stripe.first, stripe.second, worker);
+       }
+   }
+}
+
+/**
+ * reduce over a packed_array. Each nodelet reduces its own stripe of words
+ * into a replicated partial sum, then the partial sums are combined.
+ */
+template<class Policy, class T,
+   class U = std::remove_const_t<T>, class BinaryOp = std::plus<>,
+   // Disable if first argument is not an execution policy
+   // The default policy is resolved by the overload below
+   std::enable_if_t<is_execution_policy_v<Policy>
+       && !std::is_same_v<Policy, default_policy_t>, int> = 0
+>
+U
+reduce(
+   Policy policy,
+   packed_iterator<T> first, packed_iterator<T> last,
+   U init = U{}, BinaryOp binary_op = std::plus<>()
+){
+   using serial_policy = remove_parallel_t<Policy>;
+   if (last - first == 0) {
+       return init;
+   } else if constexpr (std::is_same_v<serial_policy, Policy>) {
+       return detail::reduce(seq, first, last, init, binary_op);
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       return reduce(serial_policy(), first, last, init, binary_op);
+   } else {
+       detail::packed_reduce_schedule_t<Policy> local_policy;
+       // Allocate a partial sum on each nodelet
+       // Nodelets that hold no part of the range contribute nothing
+       auto partials = emu::make_repl<detail::reduce_partial<U>>(
+           detail::reduce_partial<U>{init, false});
+       for (long k = 0; k < nodelets(); ++k) {
+           auto stripe = detail::packed_stripe(first, last, k);
+           if (stripe.first == stripe.second) { continue; }
+           cilk_migrate_hint(stripe.first.word());
+           partials->get_nth(k) = cilk_spawn detail::partial_reduce(
+               local_policy, stripe.first, stripe.second, init, binary_op);
+       }
+       // Wait for all partial sums to be computed
+       cilk_sync;
+       // Reduce across the partial sums, then fold in init once
+       return detail::fold_init(init, repl_reduce(*partials,
+           [=](const auto& lhs, const auto& rhs) {
+               return detail::combine_partials(lhs, rhs, binary_op);
+           }), binary_op);
+   }
+}
+
+// Default policy: pick the schedule from the runtime configuration
+// These must be declared here, since the generic overloads can't see the ones
+// above
+template<class T, class UnaryFunction>
+void
+for_each(
+   default_policy_t,
+   packed_iterator<T> begin, packed_iterator<T> end,
+   UnaryFunction worker
+){
+   visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+       for_each(policy, begin, end, worker);
+   });
+}
+
+template<class T, class UnaryFunction>
+void
+for_each(packed_iterator<T> begin, packed_iterator<T> end, UnaryFunction worker)
+{
+   for_each(emu::default_policy, begin, end, worker);
+}
+
+template<class T,
+   class U = std::remove_const_t<T>, class BinaryOp = std::plus<>>
+U
+reduce(
+   default_policy_t,
+   packed_iterator<T> first, packed_iterator<T> last,
+   U init = U{}, BinaryOp binary_op = std::plus<>()
+){
+   return visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+       return reduce(policy, first, last, init, binary_op);
+   });
+}
+
+template<class T,
+   class U = std::remove_const_t<T>, class BinaryOp = std::plus<>>
+U
+reduce(
+   packed_iterator<T> first, packed_iterator<T> last,
+   U init = U{}, BinaryOp binary_op = std::plus<>()
+){
+   return reduce(emu::default_policy, first, last, init, binary_op);
+}
+
+} // end namespace emu::parallel
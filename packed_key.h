@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "intrinsics.h"
+
+namespace emu {
+
+namespace detail {
+
+// Maps a key to an unsigned value with the same ordering, in key_bits bits
+template<class Key>
+inline unsigned long
+order_key(Key key, long key_bits)
+{
+    if constexpr (std::is_same_v<Key, float>) {
+        // Flip every bit of negative values, and just the sign bit of
+        // positive values, so that the bits sort like the floats
+        unsigned int bits;
+        std::memcpy(&bits, &key, sizeof(bits));
+        return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+    } else if constexpr (std::is_signed_v<Key>) {
+        // Bias by 2^(key_bits-1) so the most negative key maps to zero
+        assert(key >= -(1L << (key_bits - 1))
+            && key < (1L << (key_bits - 1)));
+        return static_cast<unsigned long>(static_cast<long>(key))
+            + (1UL << (key_bits - 1));
+    } else {
+        assert(static_cast<unsigned long>(key) < (1UL << key_bits));
+        return static_cast<unsigned long>(key);
+    }
+}
+
+// Inverse of order_key
+template<class Key>
+inline Key
+unorder_key(unsigned long bits, long key_bits)
+{
+    if constexpr (std::is_same_v<Key, float>) {
+        unsigned int u = static_cast<unsigned int>(bits);
+        u = (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u;
+        Key key;
+        std::memcpy(&key, &u, sizeof(key));
+        return key;
+    } else if constexpr (std::is_signed_v<Key>) {
+        return static_cast<Key>(
+            static_cast<long>(bits - (1UL << (key_bits - 1))));
+    } else {
+        return static_cast<Key>(bits);
+    }
+}
+
+} // end namespace detail
+
+/**
+ * Packs an ordered key and an unsigned payload into one 64-bit word, so that
+ * comparing two words as signed longs compares their keys first and breaks
+ * ties with the payload. A single remote_min or remote_max on the word then
+ * updates the key and the payload together, e.g. "set (dist, parent) if dist
+ * is smaller" for SSSP or BFS, without a CAS loop.
+ *
+ * The key takes the upper KeyBits bits and the payload the rest. Signed keys
+ * are biased and float keys have their bits rearranged so they sort
+ * correctly; the accessors undo the encoding.
+ *
+ * @tparam Key Integral type, or float (which requires KeyBits == 32)
+ * @tparam KeyBits Number of bits for the key, from 1 to 63
+ */
+template<class Key, long KeyBits = 32>
+class packed_key
+{
+    static_assert(std::is_integral_v<Key> || std::is_same_v<Key, float>,
+        "packed_key supports integral and float keys");
+    static_assert(!std::is_same_v<Key, float> || KeyBits == 32,
+        "float keys require KeyBits == 32");
+    static_assert(KeyBits >= 1 && KeyBits <= 63,
+        "packed_key needs at least one bit for the key and the payload");
+public:
+    typedef Key key_type;
+    static constexpr long key_bits = KeyBits;
+    static constexpr long payload_bits = 64 - KeyBits;
+    static constexpr unsigned long max_payload = (1UL << payload_bits) - 1;
+
+    // Identity for remote_min: greater than or equal to any packed word
+    static constexpr long min_identity = std::numeric_limits<long>::max();
+    // Identity for remote_max: less than or equal to any packed word
+    static constexpr long max_identity = std::numeric_limits<long>::min();
+
+    // Packs key and payload into a word
+    static long
+    pack(Key key, unsigned long payload)
+    {
+        assert(payload <= max_payload);
+        unsigned long bits = (detail::order_key(key, KeyBits) << payload_bits)
+            | payload;
+        // Flip the top bit so signed comparison matches unsigned order
+        return static_cast<long>(bits ^ (1UL << 63));
+    }
+
+    // Returns the key stored in a packed word
+    static Key
+    key(long word)
+    {
+        unsigned long bits = static_cast<unsigned long>(word) ^ (1UL << 63);
+        return detail::unorder_key<Key>(bits >> payload_bits, KeyBits);
+    }
+
+    // Returns the payload stored in a packed word
+    static unsigned long
+    payload(long word)
+    {
+        return static_cast<unsigned long>(word) & max_payload;
+    }
+
+    // Sets *ptr to (key, payload) if key is smaller than the current key,
+    // without waiting for the result
+    static void
+    remote_min(volatile long * ptr, Key key, unsigned long payload)
+    {
+        emu::remote_min(ptr, pack(key, payload));
+    }
+
+    // Sets *ptr to (key, payload) if key is larger than the current key,
+    // without waiting for the result
+    static void
+    remote_max(volatile long * ptr, Key key, unsigned long payload)
+    {
+        emu::remote_max(ptr, pack(key, payload));
+    }
+
+    /**
+     * Sets *ptr to (key, payload) if key is smaller than the current key.
+     * @return true if this call lowered the word
+     */
+    static bool
+    atomic_min(volatile long * ptr, Key key, unsigned long payload)
+    {
+        long word = pack(key, payload);
+        return emu::atomic_min(ptr, word) > word;
+    }
+
+    /**
+     * Sets *ptr to (key, payload) if key is larger than the current key.
+     * @return true if this call raised the word
+     */
+    static bool
+    atomic_max(volatile long * ptr, Key key, unsigned long payload)
+    {
+        long word = pack(key, payload);
+        return emu::atomic_max(ptr, word) < word;
+    }
+};
+
+} // end namespace emu
@@ -7,6 +7,9 @@
 #include "nlet_stride_iterator.h"
 #include "replicated.h"
 #include "intrinsics.h"
+#include "cancellation.h"
+#include "thread_budget.h"
+#include "stripe_layout.h"
 
 #include <cilk/cilk.h>
 extern "C" {
@@ -21,112 +24,319 @@ extern "C" {
 namespace emu::parallel {
 namespace detail {
 
-template<class ForwardIt, class T, class BinaryOp>
+template<class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled>
 T
 reduce(sequenced_policy policy, ForwardIt first, ForwardIt last,
-       T init, BinaryOp binary_op)
+       T init, BinaryOp binary_op, Token token = {})
 {
+    // The whole range is a single grain, check for cancellation once
+    if (token.is_cancelled()) { return init; }
     return std::accumulate(first, last, init, binary_op);
 }
 
-template<class ForwardIt, class T, class BinaryOp>
+// Unrolled version
+template<class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled>
+T
+reduce(unroll_policy policy, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token = {})
+{
+    if (token.is_cancelled()) { return init; }
+    // Visit elements one at a time until remainder is evenly divisible by four
+    while (std::distance(first, last) % 4 != 0) {
+        init = binary_op(init, *first++);
+    }
+    for (; first != last;) {
+        // Pick up four items
+        auto e1 = *first++;
+        auto e2 = *first++;
+        auto e3 = *first++;
+        auto e4 = *first++;
+        // HACK - prevent forward propagation in Emu compiler from
+        // reordering these instructions
+        (void)NODE_ID();
+        // Combine in order without returning home
+        init = binary_op(binary_op(binary_op(binary_op(
+            init, e1), e2), e3), e4);
+        RESIZE();
+    }
+    return init;
+}
+
+/**
+ * Result of reducing part of a range. Parts of a reduction start from their
+ * first element rather than from init, so that init is folded in exactly once
+ * at the root and the result doesn't depend on the schedule. A part with no
+ * elements (empty, or skipped due to cancellation) is not valid, and value
+ * holds a placeholder.
+ */
+template<class T>
+struct reduce_partial
+{
+    T value;
+    bool valid;
+};
+
+// Combines two partial results in order, skipping any that are not valid
+template<class T, class BinaryOp>
+reduce_partial<T>
+combine_partials(const reduce_partial<T>& lhs, const reduce_partial<T>& rhs,
+    BinaryOp binary_op)
+{
+    if (!lhs.valid) { return rhs; }
+    if (!rhs.valid) { return lhs; }
+    return reduce_partial<T>{binary_op(lhs.value, rhs.value), true};
+}
+
+// Folds init into the final partial result
+template<class T, class BinaryOp>
 T
-reduce(parallel_policy policy,
+fold_init(T init, const reduce_partial<T>& partial, BinaryOp binary_op)
+{
+    return partial.valid ? binary_op(init, partial.value) : init;
+}
+
+// Reduces [first, last) with the serial version of the policy, starting from
+// the first element. init is only used as a placeholder.
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+reduce_partial<T>
+reduce_leaf(Policy policy, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token)
+{
+    if (first == last || token.is_cancelled()) {
+        return reduce_partial<T>{init, false};
+    }
+    T seed(*first);
+    return reduce_partial<T>{reduce(remove_parallel_t<Policy>(),
+        std::next(first), last, seed, binary_op, token), true};
+}
+
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+reduce_partial<T>
+reduce_tree(Policy policy, long grain, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token);
+
+// Reduces a subtree in a spawned thread
+// The thread counts against the thread budget of its nodelet while it runs
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+reduce_partial<T>
+reduce_subtree(Policy policy, long grain, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token)
+{
+    thread_budget_guard guard;
+    return reduce_tree(policy, grain, first, last, init, binary_op, token);
+}
+
+/**
+ * Reduces [first, last) with a binary tree of spawns. Each node spawns a
+ * thread for the left half of its grains, reduces the right half itself, and
+ * combines the two results. Partial sums live in the stack frames of the tree,
+ * so there is no allocation, no two threads write to neighboring words, and
+ * the combine step runs in parallel rather than in a serial loop at the end.
+ * Results are combined in order, so binary_op need not be commutative.
+ * Each grain is reduced with the serial version of the policy, starting from
+ * its first element; init is only a placeholder for empty subtrees.
+ */
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+reduce_partial<T>
+reduce_tree(Policy policy, long grain, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token)
+{
+    long n = std::distance(first, last);
+    if (n <= grain) {
+        return reduce_leaf(policy, first, last, init, binary_op, token);
+    }
+    // Stop spawning once the reduction has been cancelled
+    // Subtrees that are skipped due to cancellation contribute nothing
+    if (token.is_cancelled()) { return reduce_partial<T>{init, false}; }
+    // Split on a grain boundary
+    long num_grains = (n + grain - 1) / grain;
+    auto mid = first + (num_grains / 2) * grain;
+    cilk_migrate_hint(ptr_from_iter(first));
+    reduce_partial<T> left = cilk_spawn reduce_subtree(
+        policy, grain, first, mid, init, binary_op, token);
+    reduce_partial<T> right = reduce_tree(
+        policy, grain, mid, last, init, binary_op, token);
+    cilk_sync;
+    return combine_partials(left, right, binary_op);
+}
+
+// Reduce each grain-sized chunk in its own thread and combine the partial sums
+// init is folded in once, at the root
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+T
+reduce_grains(Policy policy, long grain,
+       ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token)
+{
+    return fold_init(init, reduce_tree(
+        policy, grain, first, last, init, binary_op, token), binary_op);
+}
+
+template<class Policy, class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled,
+    std::enable_if_t<is_parallel_policy_v<Policy>, int> = 0>
+T
+reduce(Policy policy,
        ForwardIt first, ForwardIt last,
-       T init, BinaryOp binary_op)
-{
-    // Compute number of spawns that will occur based on grain size
-    auto grain = policy.grain_;
-    long num_spawns = (std::distance(first, last) + grain - 1) / grain;
-    // Allocate a private T for each thread that will be spawned
-    std::vector<T> partial_sums(num_spawns);
-    long tid = 0;
-    // Serial spawn over each granule
-    for (;first < last; first += grain) {
-        // Spawn a thread to handle each granule
-        // Last iteration may be smaller if things don't divide evenly
-        auto begin = first;
-        auto end = begin + grain <= last ? begin + grain : last;
-        // Spawned thread will copy result to i'th partial sum
-        // NOTE: this line causes an internal compiler error on GCC 7
-        cilk_migrate_hint(ptr_from_iter(begin));
-        partial_sums[tid] = cilk_spawn reduce(
-            seq, begin, end, init, binary_op);
-        // Moving the increment out of the spawn expression to avoid possible race
-        // This shouldn't be necessary, but the compiler gets this wrong
-        tid += 1;
+       T init, BinaryOp binary_op, Token token = {})
+{
+    return reduce_grains(policy, get_grain(policy),
+        first, last, init, binary_op, token);
+}
+
+template<class Policy, class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled,
+    std::enable_if_t<is_static_policy_v<Policy>, int> = 0>
+T
+reduce(Policy policy, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token = {})
+{
+    // Recalculate grain size to limit thread count
+    // and forward to unlimited parallel version
+    return reduce_grains(policy, compute_fixed_grain(policy, first, last),
+        first, last, init, binary_op, token);
+}
+
+// Dynamic version
+// Reduces grains claimed from a shared counter until the range runs out
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+reduce_partial<T>
+dyn_reduce_worker(Policy policy, long* next_ptr, ForwardIt first, long n,
+       T init, BinaryOp binary_op, Token token)
+{
+    thread_budget_guard guard;
+    long grain = get_grain(policy);
+    // Workers that don't claim any grains contribute nothing
+    reduce_partial<T> sum{init, false};
+    // Atomically grab grains off the range
+    for (long next = atomic_addms(next_ptr, grain);
+         next < n;
+         next = atomic_addms(next_ptr, grain))
+    {
+        if (token.is_cancelled()) { break; }
+        long last = next + grain < n ? next + grain : n;
+        sum = combine_partials(sum, reduce_leaf(policy,
+            first + next, first + last, init, binary_op, token), binary_op);
+    }
+    return sum;
+}
+
+// Spawns num_threads workers as a binary tree and combines their sums on the
+// way back up
+template<class Policy, class ForwardIt, class T, class BinaryOp, class Token>
+reduce_partial<T>
+dyn_reduce_tree(Policy policy, long* next_ptr, ForwardIt first, long n,
+       long num_threads, T init, BinaryOp binary_op, Token token)
+{
+    if (num_threads <= 1) {
+        return dyn_reduce_worker(
+            policy, next_ptr, first, n, init, binary_op, token);
     }
-    // Wait for all partial sums to be valid
+    long half = num_threads / 2;
+    reduce_partial<T> left = cilk_spawn dyn_reduce_tree(
+        policy, next_ptr, first, n, half, init, binary_op, token);
+    reduce_partial<T> right = dyn_reduce_tree(
+        policy, next_ptr, first, n, num_threads - half, init, binary_op, token);
     cilk_sync;
-    // Reduce partial sums in this thread
-    return reduce(seq, partial_sums.begin(), partial_sums.end(),
-        init, binary_op);
+    return combine_partials(left, right, binary_op);
 }
 
-template<class ForwardIt, class T, class BinaryOp>
+/**
+ * Reduces [first, last) with any policy, without folding in init. This lets
+ * callers that split a range into parts (i.e. one per nodelet) combine the
+ * parts first and fold in init once at the end.
+ */
+template<class Policy, class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled>
+reduce_partial<T>
+partial_reduce(Policy policy, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token = {})
+{
+    if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        return reduce_leaf(policy, first, last, init, binary_op, token);
+    } else if constexpr (is_dynamic_policy_v<Policy>) {
+        // Index of the next grain to process
+        long next = 0;
+        return dyn_reduce_tree(policy, &next, first,
+            std::distance(first, last), get_threads_per_nodelet(policy),
+            init, binary_op, token);
+    } else if constexpr (is_static_policy_v<Policy>) {
+        return reduce_tree(policy, compute_fixed_grain(policy, first, last),
+            first, last, init, binary_op, token);
+    } else {
+        return reduce_tree(policy, get_grain(policy),
+            first, last, init, binary_op, token);
+    }
+}
+
+/**
+ * Grains are claimed by index from a counter in this stack frame, so this
+ * works with any random-access iterator, including nlet_stride_iterator.
+ * Grains are combined in the order they were claimed, so binary_op must be
+ * commutative.
+ */
+template<class Policy, class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled,
+    std::enable_if_t<is_dynamic_policy_v<Policy>, int> = 0>
 T
-striped_reduce(parallel_policy policy,
+reduce(Policy policy, ForwardIt first, ForwardIt last,
+       T init, BinaryOp binary_op, Token token = {})
+{
+    return fold_init(init, partial_reduce(
+        policy, first, last, init, binary_op, token), binary_op);
+}
+
+/**
+ * Reduces each nodelet's stripe of [first, last) into a replicated partial
+ * sum, then combines the partial sums and folds in init once. Nodelets that
+ * hold no part of the range contribute nothing.
+ */
+template<class Policy, class ForwardIt, class T, class BinaryOp,
+    class Token = never_cancelled>
+T
+striped_reduce(Policy policy,
                ForwardIt first, ForwardIt last,
-               T init, BinaryOp binary_op)
+               T init, BinaryOp binary_op, Token token = {})
 {
     // Allocate a partial sum on each nodelet
     // Using replicated storage, but we'll convert to absolute ptr later
-    auto partials = emu::make_repl_deep<T>(init);
-    // Total number of elements
-    auto size = std::distance(first, last);
-    // Number of elements in each range
-    auto stripe_size = size / NODELETS();
-    // How many nodelets have an extra element?
-    auto stripe_remainder = size % NODELETS();
+    auto partials = emu::make_repl<reduce_partial<T>>(
+        reduce_partial<T>{init, false});
+    // Number of elements on each nodelet
+    // Stripes are numbered relative to first, which may be on any nodelet
+    stripe_layout layout(std::distance(first, last));
     // Spawn a thread on each nodelet:
-    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+    for (long nlet = 0; nlet < nodelets(); ++nlet) {
         // 1. Convert from iterator to raw pointer
         // 2. Advance to the first element on the nth nodelet
         // 3. Convert to striped iterator
         auto stripe_begin = nlet_stride_iterator<ForwardIt>(first + nlet);
         // Now that the pointer has stride NODELETS(), we are addressing only
         // the elements on the nth nodelet
-        auto stripe_end = stripe_begin + stripe_size;
-        // Distribute remainder among first few nodelets
-        if (nlet < stripe_remainder) { stripe_end += 1; }
+        auto stripe_end = stripe_begin + layout.count(nlet);
         // Spawn a thread to handle each stripe
         cilk_migrate_hint(ptr_from_iter(stripe_begin));
-        partials->get_nth(nlet) = cilk_spawn reduce(
-            policy, stripe_begin, stripe_end, init, binary_op);
+        partials->get_nth(nlet) = cilk_spawn partial_reduce(
+            policy, stripe_begin, stripe_end, init, binary_op, token);
     }
     // Wait for all partial sums to be computed
     cilk_sync;
     // Reduce across the partial sums
-    return repl_reduce(partials, binary_op);
-}
-
-template<class ForwardIt, class T, class BinaryOp>
-T
-reduce(static_policy policy, ForwardIt first, ForwardIt last,
-       T init, BinaryOp binary_op)
-{
-    // Recalculate grain size to limit thread count
-    // and forward to unlimited parallel version
-    return reduce(compute_fixed_grain(policy, first, last),
-        first, last, init, binary_op);
-}
-
-template<class ForwardIt, class T, class BinaryOp>
-T
-striped_reduce(static_policy policy, ForwardIt first, ForwardIt last,
-       T init, BinaryOp binary_op)
-{
-    // Recalculate grain size to limit thread count
-    // and forward to unlimited parallel version
-    return reduce(compute_fixed_grain(policy, first, last),
-        first, last, init, binary_op);
+    return fold_init(init, repl_reduce(*partials,
+        [=](const reduce_partial<T>& lhs, const reduce_partial<T>& rhs) {
+            return combine_partials(lhs, rhs, binary_op);
+        }), binary_op);
 }
 
 } // end namespace detail
 
 // Top-level dispatch functions
 
-template<class ExecutionPolicy, class ForwardIt, class T, class BinaryOp,
+template<class ExecutionPolicy, class ForwardIt,
+    class T = typename std::iterator_traits<ForwardIt>::value_type,
+    class BinaryOp = std::plus<>,
     // Disable if first argument is not an execution policy
     std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
 >
@@ -137,6 +347,10 @@ reduce(ExecutionPolicy policy, ForwardIt first, ForwardIt last,
 {
     if (std::distance(first, last) == 0) {
         return init;
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        return reduce(remove_parallel_t<ExecutionPolicy>(),
+            first, last, init, binary_op);
     } else if (is_striped(first)){
         return detail::striped_reduce(policy, first, last, init, binary_op);
     } else {
@@ -144,8 +358,58 @@ reduce(ExecutionPolicy policy, ForwardIt first, ForwardIt last,
     }
 }
 
+// Cancellable version: the result only includes the grains that were
+// processed before the token was cancelled
+template<class ExecutionPolicy, class ForwardIt, class T, class BinaryOp,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+T
+reduce(ExecutionPolicy policy, ForwardIt first, ForwardIt last,
+    T init, BinaryOp binary_op, cancellation_ref token)
+{
+    if (std::distance(first, last) == 0) {
+        return init;
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        return reduce(remove_parallel_t<ExecutionPolicy>(),
+            first, last, init, binary_op, token);
+    } else if (is_striped(first)){
+        return detail::striped_reduce(
+            policy, first, last, init, binary_op, token);
+    } else {
+        return detail::reduce(policy, first, last, init, binary_op, token);
+    }
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class ForwardIt,
+    class T = typename std::iterator_traits<ForwardIt>::value_type,
+    class BinaryOp = std::plus<>>
+T
+reduce(default_policy_t, ForwardIt first, ForwardIt last,
+    T init = typename std::iterator_traits<ForwardIt>::value_type{},
+    BinaryOp binary_op = std::plus<>())
+{
+    return visit_default_policy</*AllowDynamic*/true>([&](auto policy) {
+        return reduce(policy, first, last, init, binary_op);
+    });
+}
+
 template<class ForwardIt, class T, class BinaryOp>
 T
+reduce(default_policy_t, ForwardIt first, ForwardIt last,
+    T init, BinaryOp binary_op, cancellation_ref token)
+{
+    return visit_default_policy</*AllowDynamic*/true>([&](auto policy) {
+        return reduce(policy, first, last, init, binary_op, token);
+    });
+}
+
+template<class ForwardIt,
+    class T = typename std::iterator_traits<ForwardIt>::value_type,
+    class BinaryOp = std::plus<>>
+T
 reduce(ForwardIt first, ForwardIt last,
     T init = typename std::iterator_traits<ForwardIt>::value_type{},
     BinaryOp binary_op = std::plus<>())
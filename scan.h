@@ -0,0 +1,570 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "execution_policy.h"
+#include "nodelets.h"
+#include "out_of_memory.h"
+#include "thread_budget.h"
+#include "segmented_reduce.h"
+
+/*
+ * Parallel prefix sums (scans), plain and segmented.
+ *
+ * The range is divided into chunks of contiguous elements, and the scan runs
+ * in three phases:
+ *   1. Each chunk computes its total in parallel
+ *   2. The chunk totals are scanned serially to get the carry into each chunk
+ *   3. Each chunk rescans its elements in parallel, starting from its carry
+ * Segment boundaries stop the carry from propagating, so the same structure
+ * handles segmented scans.
+ *
+ * Striped ranges use the same phases, but each chunk is copied into local
+ * memory one stripe at a time, so threads migrate once per nodelet instead of
+ * once per element.
+ *
+ * All scans take a monoid: an associative binary_op and its identity.
+ */
+
+namespace emu::parallel {
+namespace detail {
+
+// Total of a chunk of a segmented scan
+template<class T>
+struct scan_carry
+{
+    // True if a segment starts within the chunk
+    bool head;
+    // Combined value since the last segment head (or the chunk start)
+    T value;
+};
+
+// Phase 1: computes the total of elements [begin, end)
+template<class InputIt, class HeadFunction, class T, class BinaryOp>
+scan_carry<T>
+scan_aggregate(InputIt first, long begin, long end,
+    HeadFunction is_head, T identity, BinaryOp binary_op)
+{
+    scan_carry<T> total{false, identity};
+    for (long i = begin; i < end; ++i) {
+        if (is_head(i)) {
+            total.head = true;
+            total.value = first[i];
+        } else {
+            total.value = binary_op(total.value, first[i]);
+        }
+    }
+    return total;
+}
+
+template<class InputIt, class HeadFunction, class T, class BinaryOp>
+scan_carry<T>
+scan_aggregate_grain(InputIt first, long begin, long end,
+    HeadFunction is_head, T identity, BinaryOp binary_op)
+{
+    thread_budget_guard guard;
+    return scan_aggregate(first, begin, end, is_head, identity, binary_op);
+}
+
+// Phase 3: scans elements [begin, end), starting from carry
+template<class InputIt, class HeadFunction, class OutputIt, class T,
+    class BinaryOp>
+void
+scan_chunk(InputIt first, long begin, long end,
+    HeadFunction is_head, OutputIt out, T carry, T identity,
+    BinaryOp binary_op, bool inclusive)
+{
+    T sum = carry;
+    for (long i = begin; i < end; ++i) {
+        T x = first[i];
+        if (is_head(i)) { sum = identity; }
+        if (inclusive) {
+            sum = binary_op(sum, x);
+            out[i] = sum;
+        } else {
+            out[i] = sum;
+            sum = binary_op(sum, x);
+        }
+    }
+}
+
+template<class InputIt, class HeadFunction, class OutputIt, class T,
+    class BinaryOp>
+void
+scan_chunk_grain(InputIt first, long begin, long end,
+    HeadFunction is_head, OutputIt out, T carry, T identity,
+    BinaryOp binary_op, bool inclusive)
+{
+    thread_budget_guard guard;
+    scan_chunk(first, begin, end, is_head, out, carry, identity,
+        binary_op, inclusive);
+}
+
+// Number of elements in each chunk
+template<class Policy>
+long
+scan_grain(Policy policy, long n)
+{
+    if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        return std::max(n, 1L);
+    } else if constexpr (is_parallel_policy_v<Policy>) {
+        return get_grain(policy);
+    } else {
+        // Static and dynamic policies: limit the number of chunks
+        long grain = get_grain(policy);
+        long max_threads = get_threads_per_nodelet(policy);
+        if (n / grain > max_threads) { grain = n / max_threads; }
+        return grain;
+    }
+}
+
+// No segment heads (plain scan)
+struct no_heads
+{
+    constexpr bool operator()(long) const { return false; }
+};
+
+/**
+ * Per-chunk state, written by the thread that handles the chunk. Each one
+ * gets its own cache line, so threads writing neighboring chunks don't
+ * contend.
+ */
+template<class T>
+struct alignas(64) scan_chunk_state
+{
+    scan_carry<T> total;
+    // Local copy of a chunk of a striped range (striped scans only)
+    T* values;
+    // Head flags of the local copy, null for plain scans
+    bool* heads;
+};
+
+/**
+ * Segmented scan of a local range: each chunk is a contiguous block of
+ * elements, which the thread that handles it reads and writes in place.
+ */
+template<class Policy, class InputIt, class HeadFunction, class OutputIt,
+    class T, class BinaryOp>
+void
+local_chunked_scan(Policy policy, long grain, InputIt first, long n,
+    HeadFunction is_head, OutputIt out, T identity, BinaryOp binary_op,
+    bool inclusive)
+{
+    long num_chunks = (n + grain - 1) / grain;
+    std::unique_ptr<scan_chunk_state<T>[]> chunks(
+        new scan_chunk_state<T>[num_chunks]);
+    scan_chunk_state<T>* state = chunks.get();
+    // Phase 1: total of each chunk
+    for (long c = 0; c < num_chunks; ++c) {
+        long end = std::min(n, (c + 1) * grain);
+        cilk_migrate_hint(ptr_from_iter(first + c * grain));
+        state[c].total = cilk_spawn scan_aggregate_grain(
+            first, c * grain, end, is_head, identity, binary_op);
+    }
+    cilk_sync;
+    // Phase 2: carry into each chunk
+    T carry = identity;
+    for (long c = 0; c < num_chunks; ++c) {
+        T next = state[c].total.head
+            ? state[c].total.value
+            : binary_op(carry, state[c].total.value);
+        state[c].total.value = carry;
+        carry = next;
+    }
+    // Phase 3: rescan each chunk from its carry
+    for (long c = 0; c < num_chunks; ++c) {
+        long end = std::min(n, (c + 1) * grain);
+        cilk_migrate_hint(ptr_from_iter(out + c * grain));
+        cilk_spawn scan_chunk_grain(first, c * grain, end, is_head, out,
+            state[c].total.value, identity, binary_op, inclusive);
+    }
+    cilk_sync;
+}
+
+// Looks up head flags in the local copy of a chunk
+struct local_heads
+{
+    const bool* heads;
+    bool operator()(long j) const { return heads && heads[j]; }
+};
+
+/**
+ * Phase 1 of a striped scan: copies elements [begin, end) into local storage
+ * next to home, reading one stripe at a time so the thread migrates once per
+ * nodelet rather than once per element, then computes the chunk total.
+ */
+template<class InputIt, class HeadFunction, class T, class BinaryOp>
+void
+scan_gather_grain(InputIt first, long begin, long end, void* home,
+    HeadFunction is_head, T identity, BinaryOp binary_op,
+    scan_chunk_state<T>* state)
+{
+    thread_budget_guard guard;
+    long n = end - begin;
+    auto values = reinterpret_cast<T*>(mw_localmalloc(sizeof(T) * n, home));
+    if (!values) { EMU_OUT_OF_MEMORY(sizeof(T) * n); }
+    bool* heads = nullptr;
+    if constexpr (!std::is_same_v<HeadFunction, no_heads>) {
+        heads = reinterpret_cast<bool*>(
+            mw_localmalloc(sizeof(bool) * n, home));
+        if (!heads) { EMU_OUT_OF_MEMORY(sizeof(bool) * n); }
+    }
+    for (long s = 0; s < nodelets() && s < n; ++s) {
+        // Elements s, s + nodelets(), ... of the chunk are on one nodelet
+        for (long j = s; j < n; j += nodelets()) {
+            values[j] = first[begin + j];
+            if constexpr (!std::is_same_v<HeadFunction, no_heads>) {
+                heads[j] = is_head(begin + j);
+            }
+        }
+    }
+    state->values = values;
+    state->heads = heads;
+    state->total = scan_aggregate(values, 0, n, local_heads{heads},
+        identity, binary_op);
+}
+
+/**
+ * Phase 3 of a striped scan: scans the local copy of a chunk from its carry,
+ * then writes the results out one stripe at a time
+ */
+template<class OutputIt, class T, class BinaryOp>
+void
+scan_scatter_grain(long begin, long end, OutputIt out, T identity,
+    BinaryOp binary_op, bool inclusive, scan_chunk_state<T>* state)
+{
+    thread_budget_guard guard;
+    long n = end - begin;
+    T* values = state->values;
+    // Scan in place, scan_chunk reads each element before writing it
+    scan_chunk(values, 0, n, local_heads{state->heads}, values,
+        state->total.value, identity, binary_op, inclusive);
+    for (long s = 0; s < nodelets() && s < n; ++s) {
+        for (long j = s; j < n; j += nodelets()) {
+            out[begin + j] = values[j];
+        }
+    }
+    mw_localfree(values);
+    if (state->heads) { mw_localfree(state->heads); }
+}
+
+/**
+ * Segmented scan of a striped range. A contiguous chunk of a striped range
+ * touches every nodelet, so scanning it in place would migrate on every
+ * element. Instead each chunk is a whole number of rows (nodelets()
+ * elements), and its thread copies it into local memory one stripe at a time,
+ * scans the copy, and writes the results back one stripe at a time. Chunks
+ * are spread round-robin over the nodelets.
+ */
+template<class Policy, class InputIt, class HeadFunction, class OutputIt,
+    class T, class BinaryOp>
+void
+striped_chunked_scan(Policy policy, long grain, InputIt first, long n,
+    HeadFunction is_head, OutputIt out, T identity, BinaryOp binary_op,
+    bool inclusive)
+{
+    // Round the grain up to a whole number of rows
+    grain = nlet_mul((grain + nodelets() - 1) / nodelets());
+    long num_chunks = (n + grain - 1) / grain;
+    std::unique_ptr<scan_chunk_state<T>[]> chunks(
+        new scan_chunk_state<T>[num_chunks]);
+    scan_chunk_state<T>* state = chunks.get();
+    // Phase 1: copy each chunk to its home nodelet and compute its total
+    for (long c = 0; c < num_chunks; ++c) {
+        long begin = c * grain;
+        long end = std::min(n, begin + grain);
+        // Element (begin + c % nodelets()) is on the c'th nodelet after first
+        void* home = ptr_from_iter(
+            first + begin + std::min(nlet_mod(c), end - begin - 1));
+        cilk_migrate_hint(home);
+        cilk_spawn scan_gather_grain(first, begin, end, home,
+            is_head, identity, binary_op, &state[c]);
+    }
+    cilk_sync;
+    // Phase 2: carry into each chunk
+    T carry = identity;
+    for (long c = 0; c < num_chunks; ++c) {
+        T next = state[c].total.head
+            ? state[c].total.value
+            : binary_op(carry, state[c].total.value);
+        state[c].total.value = carry;
+        carry = next;
+    }
+    // Phase 3: rescan each local copy from its carry and write it out
+    for (long c = 0; c < num_chunks; ++c) {
+        long end = std::min(n, (c + 1) * grain);
+        cilk_migrate_hint(state[c].values);
+        cilk_spawn scan_scatter_grain(c * grain, end, out,
+            identity, binary_op, inclusive, &state[c]);
+    }
+    cilk_sync;
+}
+
+/**
+ * Segmented scan of [first, first + n) into out, where is_head(i) is true if
+ * a segment starts at element i.
+ */
+template<class Policy, class InputIt, class HeadFunction, class OutputIt,
+    class T, class BinaryOp>
+void
+chunked_scan(Policy policy, InputIt first, long n,
+    HeadFunction is_head, OutputIt out, T identity, BinaryOp binary_op,
+    bool inclusive)
+{
+    long grain = scan_grain(policy, n);
+    if (n <= grain || thread_budget_exhausted(policy)) {
+        // One chunk, no need for phases 1 and 2
+        scan_chunk(first, 0, n, is_head, out, identity, identity,
+            binary_op, inclusive);
+    } else if (is_striped(first)) {
+        striped_chunked_scan(policy, grain, first, n, is_head, out,
+            identity, binary_op, inclusive);
+    } else {
+        local_chunked_scan(policy, grain, first, n, is_head, out,
+            identity, binary_op, inclusive);
+    }
+}
+
+// Scans a range, where is_head(i) is true if a segment starts at element i
+template<class Policy, class InputIt, class HeadFunction, class OutputIt,
+    class T, class BinaryOp>
+void
+scan(Policy policy, InputIt first, InputIt last, HeadFunction is_head,
+    OutputIt out, T identity, BinaryOp binary_op, bool inclusive)
+{
+    long n = std::distance(first, last);
+    if (n == 0) {
+        return;
+    } else if constexpr (std::is_same_v<Policy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            scan(policy, first, last, is_head, out,
+                identity, binary_op, inclusive);
+        });
+    } else {
+        chunked_scan(policy, first, n, is_head,
+            out, identity, binary_op, inclusive);
+    }
+}
+
+// Scans each segment given by offsets
+template<class Policy, class InputIt, class OffsetIt, class OutputIt,
+    class T, class BinaryOp>
+void
+scan_by_offsets(Policy policy, InputIt values,
+    OffsetIt offsets_first, OffsetIt offsets_last,
+    OutputIt out, T identity, BinaryOp binary_op, bool inclusive)
+{
+    long num_segments = std::distance(offsets_first, offsets_last) - 1;
+    if (num_segments <= 0) {
+        return;
+    } else if constexpr (std::is_same_v<Policy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            scan_by_offsets(policy, values, offsets_first, offsets_last, out,
+                identity, binary_op, inclusive);
+        });
+    } else {
+        // Short segments are scanned inline, long ones in chunks
+        long grain = segment_grain_size(policy, num_segments);
+        // Place each grain near the output of its first segment
+        segment_spawn(policy, num_segments, grain,
+            [=](long s) { return out + offsets_first[s]; },
+            [=](long s) {
+                long begin = offsets_first[s];
+                long n = offsets_first[s + 1] - begin;
+                chunked_scan(policy, values + begin, n, no_heads(),
+                    out + begin, identity, binary_op, inclusive);
+            });
+    }
+}
+
+} // end namespace detail
+
+/**
+ * Describes segments by their offsets, i.e. a CSR offsets array. Segment s is
+ * [offsets[s], offsets[s+1]). Pass to the segmented scans instead of head
+ * flags.
+ */
+template<class OffsetIt>
+struct segment_offsets_t
+{
+    OffsetIt first;
+    OffsetIt last;
+};
+
+template<class OffsetIt>
+segment_offsets_t<OffsetIt>
+segment_offsets(OffsetIt first, OffsetIt last)
+{
+    return segment_offsets_t<OffsetIt>{first, last};
+}
+
+/**
+ * Inclusive prefix sum: out[i] = first[0] op first[1] op ... op first[i]
+ * @param identity Identity element of binary_op
+ */
+template<class ExecutionPolicy, class InputIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+inclusive_scan(ExecutionPolicy policy, InputIt first, InputIt last,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    detail::scan(policy, first, last, detail::no_heads(),
+        out, identity, binary_op, true);
+}
+
+/**
+ * Exclusive prefix sum: out[i] = identity op first[0] op ... op first[i-1]
+ * @param identity Identity element of binary_op
+ */
+template<class ExecutionPolicy, class InputIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+exclusive_scan(ExecutionPolicy policy, InputIt first, InputIt last,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    detail::scan(policy, first, last, detail::no_heads(),
+        out, identity, binary_op, false);
+}
+
+/**
+ * Segmented inclusive scan with head flags: a new segment starts at every
+ * element i where head_flags[i] is true, and the scan restarts from there.
+ * @param identity Identity element of binary_op
+ */
+template<class ExecutionPolicy, class InputIt, class FlagIt, class OutputIt,
+    class T, class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+segmented_inclusive_scan(ExecutionPolicy policy,
+    InputIt first, InputIt last, FlagIt head_flags,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    detail::scan(policy, first, last,
+        [=](long i) { return static_cast<bool>(head_flags[i]); },
+        out, identity, binary_op, true);
+}
+
+// Segmented exclusive scan with head flags. The first element of each
+// segment gets the identity.
+template<class ExecutionPolicy, class InputIt, class FlagIt, class OutputIt,
+    class T, class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+segmented_exclusive_scan(ExecutionPolicy policy,
+    InputIt first, InputIt last, FlagIt head_flags,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    detail::scan(policy, first, last,
+        [=](long i) { return static_cast<bool>(head_flags[i]); },
+        out, identity, binary_op, false);
+}
+
+/**
+ * Segmented inclusive scan with offsets, i.e. the rank of each edge within its
+ * vertex's adjacency list. Segments are divided among threads; short segments
+ * are scanned inline, and long ones are split into chunks.
+ * @param values Values, segment s is values[offsets[s]] to values[offsets[s+1]-1]
+ * @param out Output, indexed the same as values
+ * @param identity Identity element of binary_op
+ */
+template<class ExecutionPolicy, class InputIt, class OffsetIt, class OutputIt,
+    class T, class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+segmented_inclusive_scan(ExecutionPolicy policy,
+    InputIt values, segment_offsets_t<OffsetIt> offsets,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    detail::scan_by_offsets(policy, values, offsets.first, offsets.last,
+        out, identity, binary_op, true);
+}
+
+// Segmented exclusive scan with offsets
+template<class ExecutionPolicy, class InputIt, class OffsetIt, class OutputIt,
+    class T, class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+segmented_exclusive_scan(ExecutionPolicy policy,
+    InputIt values, segment_offsets_t<OffsetIt> offsets,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    detail::scan_by_offsets(policy, values, offsets.first, offsets.last,
+        out, identity, binary_op, false);
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class InputIt, class OutputIt, class T, class BinaryOp = std::plus<>>
+void
+inclusive_scan(InputIt first, InputIt last,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    inclusive_scan(emu::default_policy, first, last, out, identity, binary_op);
+}
+
+template<class InputIt, class OutputIt, class T, class BinaryOp = std::plus<>>
+void
+exclusive_scan(InputIt first, InputIt last,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    exclusive_scan(emu::default_policy, first, last, out, identity, binary_op);
+}
+
+template<class InputIt, class FlagIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>>
+void
+segmented_inclusive_scan(InputIt first, InputIt last, FlagIt head_flags,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    segmented_inclusive_scan(emu::default_policy, first, last, head_flags,
+        out, identity, binary_op);
+}
+
+template<class InputIt, class FlagIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>>
+void
+segmented_exclusive_scan(InputIt first, InputIt last, FlagIt head_flags,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    segmented_exclusive_scan(emu::default_policy, first, last, head_flags,
+        out, identity, binary_op);
+}
+
+template<class InputIt, class OffsetIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>>
+void
+segmented_inclusive_scan(InputIt values, segment_offsets_t<OffsetIt> offsets,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    segmented_inclusive_scan(emu::default_policy, values, offsets,
+        out, identity, binary_op);
+}
+
+template<class InputIt, class OffsetIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>>
+void
+segmented_exclusive_scan(InputIt values, segment_offsets_t<OffsetIt> offsets,
+    OutputIt out, T identity, BinaryOp binary_op = std::plus<>())
+{
+    segmented_exclusive_scan(emu::default_policy, values, offsets,
+        out, identity, binary_op);
+}
+
+} // end namespace emu::parallel
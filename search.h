@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "execution_policy.h"
+#include "thread_budget.h"
+#include "repl_array.h"
+#include "block_array.h"
+#include "segmented_reduce.h"
+
+namespace emu {
+
+/**
+ * Two-level search index over a sorted range, for answering many lower_bound
+ * queries with at most one migration per query.
+ *
+ * A binary search over a striped array migrates at almost every probe. The
+ * index instead keeps a copy of the data in a block_array, so each block of
+ * consecutive elements is on a single nodelet, and a replicated sample
+ * holding the first element of each block. A query searches the sample on
+ * the local nodelet to find its block, migrates once to the block's nodelet,
+ * and finishes the search there.
+ *
+ * The index is a snapshot: it must be rebuilt if the data changes.
+ * It uses one extra copy of the data, plus (size / block_size) elements on
+ * each nodelet for the sample.
+ *
+ * @tparam T Element type
+ */
+template<class T>
+class sorted_index
+{
+private:
+    long n_;
+    long block_size_;
+    long num_blocks_;
+    // First element of each block, replicated on every nodelet
+    repl_array<T> samples_;
+    // Copy of the data, one block per nodelet in turn
+    block_array<T> blocks_;
+
+public:
+    /**
+     * Lightweight handle for searching the index from worker threads.
+     * Holds only pointers and sizes, so it can be copied into each thread.
+     */
+    class searcher
+    {
+    private:
+        long n_;
+        long block_size_;
+        long num_blocks_;
+        // View-0 pointer, resolves to the local copy on every nodelet
+        const T* samples_;
+        block_iterator<T> blocks_;
+    public:
+        searcher(long n, long block_size, long num_blocks,
+            const T* samples, block_iterator<T> blocks)
+        : n_(n), block_size_(block_size), num_blocks_(num_blocks)
+        , samples_(samples), blocks_(blocks) {}
+
+        // Returns the index of the first element that is not less than x
+        template<class Compare = std::less<>>
+        long lower_bound(const T& x, Compare comp = Compare()) const
+        {
+            // Local search: find the last block whose first element is < x
+            long b = std::lower_bound(samples_, samples_ + num_blocks_, x, comp)
+                - samples_ - 1;
+            if (b < 0) { return 0; }
+            // Migrate to the block and finish the search there
+            long first = b * block_size_;
+            long len = std::min(block_size_, n_ - first);
+            const T* block = (blocks_ + first).ptr();
+            return first + (std::lower_bound(block, block + len, x, comp) - block);
+        }
+    };
+
+    /**
+     * Builds an index over the sorted range [first, last)
+     * @param block_size Number of consecutive elements searched after the
+     * migration. Larger blocks make the replicated sample smaller.
+     */
+    template<class Iterator>
+    sorted_index(Iterator first, Iterator last, long block_size = 256)
+    : n_(std::distance(first, last))
+    , block_size_(block_size)
+    , num_blocks_((n_ + block_size - 1) / block_size)
+    , samples_(std::max(num_blocks_, 1L))
+    , blocks_(std::max(n_, 1L), block_size)
+    {
+        long n = n_;
+        repl_array<T>* samples = &samples_;
+        block_array<T>* blocks = &blocks_;
+        // Copy each block on its own nodelet
+        parallel::detail::for_each_block(par, blocks_, num_blocks_,
+            [=](long b) {
+                long begin = b * block_size;
+                long len = std::min(block_size, n - begin);
+                T* dst = blocks->block(b);
+                std::copy(first + begin, first + begin + len, dst);
+                // Broadcast the first element to every nodelet
+                for (long nlet = 0; nlet < nodelets(); ++nlet) {
+                    samples->get_nth(nlet)[b] = dst[0];
+                }
+            });
+    }
+
+    long size() const { return n_; }
+    long block_size() const { return block_size_; }
+
+    searcher get_searcher()
+    {
+        return searcher(n_, block_size_, num_blocks_,
+            samples_.data(), blocks_.begin());
+    }
+
+    // Returns the index of the first element that is not less than x
+    long lower_bound(const T& x) { return get_searcher().lower_bound(x); }
+};
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+// Applies search to four queries at a time, without returning home
+template<class InputIt, class OutputIt, class Search>
+void
+search_grain(InputIt queries, OutputIt out, long first, long last,
+    Search search)
+{
+    thread_budget_guard guard;
+    // Visit queries one at a time until remainder is evenly divisible by four
+    for (; (last - first) % 4 != 0; ++first) {
+        out[first] = search(queries[first]);
+    }
+    for (; first < last; first += 4) {
+        // Pick up four queries
+        auto q1 = queries[first];
+        auto q2 = queries[first + 1];
+        auto q3 = queries[first + 2];
+        auto q4 = queries[first + 3];
+        // HACK - prevent forward propagation in Emu compiler from
+        // reordering these instructions
+        (void)NODE_ID();
+        // Search for each one, results are remote writes
+        out[first] = search(q1);
+        out[first + 1] = search(q2);
+        out[first + 2] = search(q3);
+        out[first + 3] = search(q4);
+    }
+}
+
+} // end namespace detail
+
+/**
+ * Batched lower_bound: for each query in [queries_first, queries_last), writes
+ * the index of the first element of the indexed range that is not less than
+ * the query to the corresponding position of out.
+ *
+ * Queries are divided among threads in grains. Each thread picks up four
+ * queries at a time, so the migrations to the blocks are not interleaved with
+ * trips back to the query array. Sorting the queries first makes consecutive
+ * queries hit the same block, which avoids most of the remaining migrations.
+ */
+template<class ExecutionPolicy, class T, class InputIt, class OutputIt,
+    class Compare = std::less<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+lower_bound(ExecutionPolicy policy, sorted_index<T>& index,
+    InputIt queries_first, InputIt queries_last, OutputIt out,
+    Compare comp = Compare())
+{
+    long num_queries = std::distance(queries_first, queries_last);
+    if (num_queries == 0) {
+        return;
+    } else if constexpr (std::is_same_v<ExecutionPolicy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            lower_bound(policy, index, queries_first, queries_last, out, comp);
+        });
+    } else {
+        auto searcher = index.get_searcher();
+        auto search = [=](const T& x) { return searcher.lower_bound(x, comp); };
+        if constexpr (std::is_same_v<remove_parallel_t<ExecutionPolicy>,
+            ExecutionPolicy>) {
+            detail::search_grain(queries_first, out, 0, num_queries, search);
+        } else {
+            long grain = detail::segment_grain_size(policy, num_queries);
+            for (long first = 0; first < num_queries; first += grain) {
+                long last = std::min(first + grain, num_queries);
+                cilk_migrate_hint(ptr_from_iter(queries_first + first));
+                cilk_spawn detail::search_grain(
+                    queries_first, out, first, last, search);
+            }
+        }
+    }
+}
+
+template<class T, class InputIt, class OutputIt>
+void
+lower_bound(sorted_index<T>& index,
+    InputIt queries_first, InputIt queries_last, OutputIt out)
+{
+    lower_bound(emu::default_policy, index, queries_first, queries_last, out);
+}
+
+} // end namespace emu::parallel
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <cilk/cilk.h>
+#include "execution_policy.h"
+#include "thread_budget.h"
+#include "striped_array.h"
+#include "reduce.h"
+
+namespace emu::parallel {
+namespace detail {
+
+// Calls worker(s) for each segment index in [first, last)
+template<class SegmentFunction>
+void
+segment_grain(long first, long last, SegmentFunction worker)
+{
+    thread_budget_guard guard;
+    for (long s = first; s < last; ++s) { worker(s); }
+}
+
+/**
+ * Calls worker(s) for each segment index s in [0, num_segments). Parallel
+ * policies spawn a thread for every grain of segments, near the first
+ * segment of the grain. Serial policies loop over the segments in order.
+ *
+ * @param hint Function that maps a segment index to an iterator to the data
+ * of that segment, used to place the threads
+ */
+template<class Policy, class HintFunction, class SegmentFunction>
+void
+segment_spawn(Policy policy, long num_segments, long grain,
+    HintFunction hint, SegmentFunction worker)
+{
+    if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        for (long s = 0; s < num_segments; ++s) { worker(s); }
+    } else {
+        for (long s = 0; s < num_segments; s += grain) {
+            long last = std::min(s + grain, num_segments);
+            cilk_migrate_hint(ptr_from_iter(hint(s)));
+            cilk_spawn segment_grain(s, last, worker);
+        }
+    }
+}
+
+// Number of segments handled by each thread
+template<class Policy>
+long
+segment_grain_size(Policy policy, long num_segments)
+{
+    if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        // Serial policies: all segments in one grain
+        return std::max(num_segments, 1L);
+    } else if constexpr (is_parallel_policy_v<Policy>) {
+        return get_grain(policy);
+    } else {
+        // Static and dynamic policies: limit the number of threads
+        long grain = get_grain(policy);
+        long max_threads = get_threads_per_nodelet(policy);
+        if (num_segments / grain > max_threads) {
+            grain = num_segments / max_threads;
+        }
+        return grain;
+    }
+}
+
+/**
+ * Reduces one segment. Segments longer than the grain size are reduced in
+ * parallel with partial combination, shorter ones are reduced inline.
+ */
+template<class Policy, class ForwardIt, class T, class BinaryOp>
+T
+reduce_segment(Policy policy, ForwardIt first, ForwardIt last,
+    T init, BinaryOp binary_op)
+{
+    if constexpr (!std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        if (std::distance(first, last) > get_grain(policy)
+            && !thread_budget_exhausted(policy)) {
+            long grain = is_parallel_policy_v<Policy>
+                ? get_grain(policy)
+                : compute_fixed_grain(policy, first, last);
+            return reduce_grains(policy, grain,
+                first, last, init, binary_op, never_cancelled{});
+        }
+    }
+    return detail::reduce(seq, first, last, init, binary_op);
+}
+
+// True if a run of equal keys starts at index i
+template<class KeyIt>
+bool
+is_run_head(KeyIt keys, long i)
+{
+    return i == 0 || !(keys[i] == keys[i - 1]);
+}
+
+/**
+ * Number of run heads in a subtree of chunks. Each one gets its own cache
+ * line, so threads writing neighboring nodes of the tree don't contend.
+ */
+struct alignas(64) run_head_count
+{
+    long value;
+};
+
+template<class KeyIt>
+long
+count_run_heads(KeyIt keys, long n, long chunk, long lo, long hi,
+    long node, run_head_count* counts);
+
+// Counts a subtree of chunks in a spawned thread
+// The thread counts against the thread budget of its nodelet while it runs
+template<class KeyIt>
+long
+count_run_heads_subtree(KeyIt keys, long n, long chunk, long lo, long hi,
+    long node, run_head_count* counts)
+{
+    thread_budget_guard guard;
+    return count_run_heads(keys, n, chunk, lo, hi, node, counts);
+}
+
+/**
+ * Counts the run heads in chunks [lo, hi) of the keys with a binary tree of
+ * spawns. The count of each node of the tree is saved in counts[node], where
+ * the children of node are 2 * node and 2 * node + 1, so that
+ * write_run_offsets can find where each subtree's runs start without a serial
+ * prefix sum over the chunks.
+ */
+template<class KeyIt>
+long
+count_run_heads(KeyIt keys, long n, long chunk, long lo, long hi,
+    long node, run_head_count* counts)
+{
+    long count = 0;
+    if (hi - lo == 1) {
+        long last = std::min(n, hi * chunk);
+        for (long i = lo * chunk; i < last; ++i) {
+            if (is_run_head(keys, i)) { ++count; }
+        }
+    } else {
+        long mid = lo + (hi - lo) / 2;
+        cilk_migrate_hint(ptr_from_iter(keys + lo * chunk));
+        long left = cilk_spawn count_run_heads_subtree(
+            keys, n, chunk, lo, mid, 2 * node, counts);
+        long right = count_run_heads(
+            keys, n, chunk, mid, hi, 2 * node + 1, counts);
+        cilk_sync;
+        count = left + right;
+    }
+    counts[node].value = count;
+    return count;
+}
+
+template<class KeyIt>
+void
+write_run_offsets(KeyIt keys, long n, long chunk, long lo, long hi,
+    long node, const run_head_count* counts, long r, long* run_offsets);
+
+// Writes a subtree of chunks in a spawned thread
+// The thread counts against the thread budget of its nodelet while it runs
+template<class KeyIt>
+void
+write_run_offsets_subtree(KeyIt keys, long n, long chunk, long lo, long hi,
+    long node, const run_head_count* counts, long r, long* run_offsets)
+{
+    thread_budget_guard guard;
+    write_run_offsets(keys, n, chunk, lo, hi, node, counts, r, run_offsets);
+}
+
+/**
+ * Writes the offset of each run that starts in chunks [lo, hi) to
+ * run_offsets, starting at run r. Walks the same tree as count_run_heads, so
+ * the runs of the right subtree start after the count saved for the left one.
+ */
+template<class KeyIt>
+void
+write_run_offsets(KeyIt keys, long n, long chunk, long lo, long hi,
+    long node, const run_head_count* counts, long r, long* run_offsets)
+{
+    if (hi - lo == 1) {
+        long last = std::min(n, hi * chunk);
+        for (long i = lo * chunk; i < last; ++i) {
+            if (is_run_head(keys, i)) { run_offsets[r++] = i; }
+        }
+        return;
+    }
+    long mid = lo + (hi - lo) / 2;
+    cilk_migrate_hint(ptr_from_iter(keys + lo * chunk));
+    cilk_spawn write_run_offsets_subtree(
+        keys, n, chunk, lo, mid, 2 * node, counts, r, run_offsets);
+    write_run_offsets(keys, n, chunk, mid, hi, 2 * node + 1, counts,
+        r + counts[2 * node].value, run_offsets);
+    cilk_sync;
+}
+
+} // end namespace detail
+
+/**
+ * Reduces each segment of a range. Segment s is [values[offsets[s]],
+ * values[offsets[s+1]]), so offsets is the CSR offsets array, and the result
+ * for segment s is written to out[s].
+ *
+ * Segments are divided among threads in grains. Short segments are reduced
+ * inline by the thread that owns them, while segments longer than the grain
+ * size are split across threads and the partial results are combined. This
+ * keeps a few huge segments (i.e. high-degree vertices) from serializing the
+ * whole reduction.
+ *
+ * init is combined exactly once with the result of each segment, so the
+ * result for an empty segment is init.
+ *
+ * @param offsets_first, offsets_last Offsets of the segments (one more than the
+ * number of segments)
+ */
+template<class ExecutionPolicy, class ForwardIt, class OffsetIt,
+    class OutputIt, class T, class BinaryOp,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+segmented_reduce(ExecutionPolicy policy,
+    ForwardIt values, OffsetIt offsets_first, OffsetIt offsets_last,
+    OutputIt out, T init, BinaryOp binary_op)
+{
+    long num_segments = std::distance(offsets_first, offsets_last) - 1;
+    if (num_segments <= 0) {
+        return;
+    } else if constexpr (std::is_same_v<ExecutionPolicy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            segmented_reduce(policy, values, offsets_first, offsets_last,
+                out, init, binary_op);
+        });
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        segmented_reduce(remove_parallel_t<ExecutionPolicy>(),
+            values, offsets_first, offsets_last, out, init, binary_op);
+    } else {
+        long grain = detail::segment_grain_size(policy, num_segments);
+        detail::segment_spawn(policy, num_segments, grain,
+            [=](long s) { return out + s; },
+            [=](long s) {
+                out[s] = detail::reduce_segment(policy,
+                    values + offsets_first[s], values + offsets_first[s + 1],
+                    init, binary_op);
+            });
+    }
+}
+
+template<class ForwardIt, class OffsetIt, class OutputIt, class T,
+    class BinaryOp = std::plus<>>
+void
+segmented_reduce(
+    ForwardIt values, OffsetIt offsets_first, OffsetIt offsets_last,
+    OutputIt out, T init, BinaryOp binary_op = std::plus<>())
+{
+    segmented_reduce(emu::default_policy,
+        values, offsets_first, offsets_last, out, init, binary_op);
+}
+
+/**
+ * For each run of equal consecutive keys in [keys_first, keys_last), writes
+ * the key to keys_out and the reduction of the corresponding values to
+ * values_out. Keys must be sorted (or at least grouped).
+ *
+ * Finds the start of each run in parallel, then forwards to
+ * segmented_reduce.
+ *
+ * @return The number of runs (unique keys)
+ */
+template<class ExecutionPolicy, class KeyIt, class ValueIt,
+    class KeyOutputIt, class ValueOutputIt, class T, class BinaryOp,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+long
+reduce_by_key(ExecutionPolicy policy,
+    KeyIt keys_first, KeyIt keys_last, ValueIt values,
+    KeyOutputIt keys_out, ValueOutputIt values_out,
+    T init, BinaryOp binary_op)
+{
+    long n = std::distance(keys_first, keys_last);
+    if (n == 0) { return 0; }
+    if constexpr (std::is_same_v<ExecutionPolicy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        return visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            return reduce_by_key(policy, keys_first, keys_last, values,
+                keys_out, values_out, init, binary_op);
+        });
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        return reduce_by_key(remove_parallel_t<ExecutionPolicy>(),
+            keys_first, keys_last, values, keys_out, values_out,
+            init, binary_op);
+    } else {
+        // 1. Count run heads in each chunk of keys
+        long chunk = detail::segment_grain_size(policy, n);
+        long num_chunks = (n + chunk - 1) / chunk;
+        // Counts for each node of the spawn tree over the chunks
+        std::unique_ptr<detail::run_head_count[]> counts(
+            new detail::run_head_count[4 * num_chunks]);
+        long num_runs = detail::count_run_heads(
+            keys_first, n, chunk, 0, num_chunks, 1, counts.get());
+        // 2. Write the offset of each run
+        striped_array<long> offsets(num_runs + 1);
+        long* run_offsets = offsets.data();
+        run_offsets[num_runs] = n;
+        detail::write_run_offsets(keys_first, n, chunk, 0, num_chunks, 1,
+            counts.get(), 0, run_offsets);
+        // 3. Copy out the keys and reduce each run
+        detail::segment_spawn(policy, num_runs,
+            detail::segment_grain_size(policy, num_runs),
+            [=](long r) { return keys_out + r; },
+            [=](long r) { keys_out[r] = keys_first[run_offsets[r]]; });
+        segmented_reduce(policy, values, run_offsets, run_offsets + num_runs + 1,
+            values_out, init, binary_op);
+        return num_runs;
+    }
+}
+
+template<class KeyIt, class ValueIt, class KeyOutputIt, class ValueOutputIt,
+    class T, class BinaryOp = std::plus<>>
+long
+reduce_by_key(
+    KeyIt keys_first, KeyIt keys_last, ValueIt values,
+    KeyOutputIt keys_out, ValueOutputIt values_out,
+    T init, BinaryOp binary_op = std::plus<>())
+{
+    return reduce_by_key(emu::default_policy, keys_first, keys_last, values,
+        keys_out, values_out, init, binary_op);
+}
+
+} // end namespace emu::parallel
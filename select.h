@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <iterator>
+#include <vector>
+#include <cilk/cilk.h>
+#include "execution_policy.h"
+#include "nlet_stride_iterator.h"
+#include "stripe_layout.h"
+#include "thread_budget.h"
+
+/*
+ * Selection algorithms: top_k and nth_element. Both make a constant number of
+ * passes over the data and never sort or copy the whole range.
+ */
+
+namespace emu::parallel {
+namespace detail {
+
+/**
+ * Keeps the k elements that come first in the order defined by comp.
+ * Stored as a heap with the worst kept element on top, so each push is
+ * O(log k) and most elements are rejected with one comparison.
+ */
+template<class T, class Compare>
+class bounded_heap
+{
+private:
+    long k_;
+    Compare comp_;
+    std::vector<T> heap_;
+public:
+    bounded_heap(long k, Compare comp) : k_(k), comp_(comp) {}
+
+    void push(const T& x)
+    {
+        if (static_cast<long>(heap_.size()) < k_) {
+            heap_.push_back(x);
+            std::push_heap(heap_.begin(), heap_.end(), comp_);
+        } else if (k_ > 0 && comp_(x, heap_.front())) {
+            std::pop_heap(heap_.begin(), heap_.end(), comp_);
+            heap_.back() = x;
+            std::push_heap(heap_.begin(), heap_.end(), comp_);
+        }
+    }
+
+    void merge(const bounded_heap& other)
+    {
+        for (const T& x : other.heap_) { push(x); }
+    }
+
+    // Sorts the kept elements in order and copies them to out
+    template<class OutputIt>
+    long sort_into(OutputIt out)
+    {
+        std::sort_heap(heap_.begin(), heap_.end(), comp_);
+        std::copy(heap_.begin(), heap_.end(), out);
+        return heap_.size();
+    }
+};
+
+// Applies map to a single grain in a spawned thread
+template<class Map, class Iterator>
+auto
+map_grain(Map map, Iterator first, Iterator last)
+{
+    thread_budget_guard guard;
+    return map(first, last);
+}
+
+/**
+ * Computes map(grain) for each grain of a local range and combines the results
+ * with combine(R, R), starting from init.
+ */
+template<class Policy, class Iterator, class R, class Map, class Combine>
+R
+map_reduce_local(Policy policy, Iterator first, Iterator last,
+    R init, Map map, Combine combine)
+{
+    if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        return combine(init, map(first, last));
+    } else {
+        long n = std::distance(first, last);
+        long grain = is_parallel_policy_v<Policy>
+            ? get_grain(policy)
+            : compute_fixed_grain(policy, first, last);
+        long num_grains = (n + grain - 1) / grain;
+        std::vector<R> partials(num_grains, init);
+        for (long g = 0; g < num_grains; ++g) {
+            auto begin = first + g * grain;
+            auto end = begin + grain <= last ? begin + grain : last;
+            cilk_migrate_hint(ptr_from_iter(begin));
+            partials[g] = cilk_spawn map_grain(map, begin, end);
+        }
+        cilk_sync;
+        for (auto& partial : partials) { init = combine(init, partial); }
+        return init;
+    }
+}
+
+/**
+ * Computes map(grain) for each grain of the range and combines the results.
+ * For striped ranges, each nodelet combines the results for its own stripe
+ * first, then the per-nodelet results are combined.
+ */
+template<class Policy, class Iterator, class R, class Map, class Combine>
+R
+map_reduce(Policy policy, Iterator first, Iterator last,
+    R init, Map map, Combine combine)
+{
+    if (first == last) {
+        return init;
+    } else if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        return map_reduce_local(policy, first, last, init, map, combine);
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        return map_reduce_local(remove_parallel_t<Policy>(),
+            first, last, init, map, combine);
+    } else if (is_striped(first)) {
+        stripe_layout layout(std::distance(first, last));
+        std::vector<R> partials(nodelets(), init);
+        for (long nlet = 0; nlet < nodelets(); ++nlet) {
+            auto stripe_begin = nlet_stride_iterator<Iterator>(first + nlet);
+            auto stripe_end = stripe_begin + layout.count(nlet);
+            cilk_migrate_hint(ptr_from_iter(stripe_begin));
+            partials[nlet] = cilk_spawn map_reduce_local(
+                policy, stripe_begin, stripe_end, init, map, combine);
+        }
+        cilk_sync;
+        for (auto& partial : partials) { init = combine(init, partial); }
+        return init;
+    } else {
+        return map_reduce_local(policy, first, last, init, map, combine);
+    }
+}
+
+// Mixes the bits of a key, to pick a pseudo-random sample
+inline unsigned long
+sample_hash(unsigned long h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Range of candidate values for nth_element, under the order comp
+template<class T, class Compare>
+struct value_bounds
+{
+    Compare comp;
+    bool has_lo = false, lo_strict = false;
+    bool has_hi = false, hi_strict = false;
+    T lo{}, hi{};
+
+    bool contains(const T& x) const
+    {
+        if (has_lo && (lo_strict ? !comp(lo, x) : comp(x, lo))) { return false; }
+        if (has_hi && (hi_strict ? !comp(x, hi) : comp(hi, x))) { return false; }
+        return true;
+    }
+};
+
+} // end namespace detail
+
+/**
+ * Copies the k elements of [first, last) that come first in the order defined
+ * by comp to out, in sorted order. Use std::greater<>() to get the k largest.
+ *
+ * Each thread keeps a bounded heap of its k best elements. The heaps are
+ * merged on each nodelet and then globally, so only O(k) elements per thread
+ * are ever copied.
+ *
+ * @return Number of elements written, min(k, last - first)
+ */
+template<class ExecutionPolicy, class Iterator, class OutputIt,
+    class Compare = std::less<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+long
+top_k(ExecutionPolicy policy, Iterator first, Iterator last, long k,
+    OutputIt out, Compare comp = Compare())
+{
+    if constexpr (std::is_same_v<ExecutionPolicy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        return visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            return top_k(policy, first, last, k, out, comp);
+        });
+    } else {
+        using T = typename std::iterator_traits<Iterator>::value_type;
+        using heap = detail::bounded_heap<T, Compare>;
+        heap result = detail::map_reduce(policy, first, last, heap(k, comp),
+            [=](auto begin, auto end) {
+                heap h(k, comp);
+                for (; begin != end; ++begin) { h.push(*begin); }
+                return h;
+            },
+            [](heap lhs, const heap& rhs) {
+                lhs.merge(rhs);
+                return lhs;
+            });
+        return result.sort_into(out);
+    }
+}
+
+/**
+ * Returns the element that would be at position nth if [first, last) were
+ * sorted by comp. Unlike std::nth_element, the range is not modified.
+ *
+ * Samples the remaining candidates to pick a pair of pivots that bracket the
+ * target rank, then counts the elements below and between the pivots to
+ * narrow down the candidates. Once few enough candidates remain, they are
+ * gathered and selected serially. Each round is two parallel passes over the
+ * data, one to sample and one to count.
+ */
+template<class ExecutionPolicy, class Iterator,
+    class Compare = std::less<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+typename std::iterator_traits<Iterator>::value_type
+nth_element(ExecutionPolicy policy, Iterator first, Iterator last, long nth,
+    Compare comp = Compare())
+{
+    using T = typename std::iterator_traits<Iterator>::value_type;
+    if constexpr (std::is_same_v<ExecutionPolicy, default_policy_t>) {
+        // Pick the schedule from the runtime configuration
+        return visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+            return nth_element(policy, first, last, nth, comp);
+        });
+    } else {
+        long n = std::distance(first, last);
+        assert(nth >= 0 && nth < n);
+        // Gather and select serially below this many candidates
+        const long gather_threshold = 4096;
+        // Number of samples and distance of the pivots from the target
+        const long num_samples = 512;
+        const long delta = 16;
+
+        detail::value_bounds<T, Compare> bounds{comp};
+        // Rank of the target within the candidates, and number of candidates
+        long rank = nth;
+        long num_candidates = n;
+        bool force_gather = false;
+        using vec = std::vector<T>;
+        auto concat = [](vec lhs, const vec& rhs) {
+            lhs.insert(lhs.end(), rhs.begin(), rhs.end());
+            return lhs;
+        };
+        for (;;) {
+            vec sample;
+            if (num_candidates > gather_threshold && !force_gather) {
+                // Sample about 8 * num_samples of the remaining candidates in
+                // parallel. Each element is kept with probability 1 / stride,
+                // by hashing its position, so the sample is spread evenly
+                // over the range however the grains fall.
+                unsigned long stride = std::max(1L,
+                    num_candidates / (8 * num_samples));
+                sample = detail::map_reduce(policy, first, last, vec(),
+                    [=](auto begin, auto end) {
+                        vec v;
+                        auto key = reinterpret_cast<unsigned long>(
+                            ptr_from_iter(begin));
+                        for (unsigned long j = 0; begin != end; ++begin, ++j) {
+                            if (detail::sample_hash(key + j) % stride != 0) {
+                                continue;
+                            }
+                            T x = *begin;
+                            if (bounds.contains(x)) { v.push_back(x); }
+                        }
+                        return v;
+                    }, concat);
+            }
+            if (sample.size() < 2) {
+                // Few candidates: gather them and select serially
+                vec candidates = detail::map_reduce(policy, first, last, vec(),
+                    [=](auto begin, auto end) {
+                        vec v;
+                        for (; begin != end; ++begin) {
+                            if (bounds.contains(*begin)) { v.push_back(*begin); }
+                        }
+                        return v;
+                    }, concat);
+                std::nth_element(candidates.begin(),
+                    candidates.begin() + rank, candidates.end(), comp);
+                return candidates[rank];
+            }
+            // Pick pivots that bracket the target rank
+            std::sort(sample.begin(), sample.end(), comp);
+            long s = sample.size();
+            long pos = rank * s / num_candidates;
+            T p_lo = sample[std::max(0L, pos - delta)];
+            T p_hi = sample[std::min(s - 1, pos + delta)];
+            // Count candidates below p_lo and at or below p_hi
+            struct counts { long below, up_to; };
+            counts c = detail::map_reduce(policy, first, last, counts{0, 0},
+                [=](auto begin, auto end) {
+                    counts local{0, 0};
+                    for (; begin != end; ++begin) {
+                        T x = *begin;
+                        if (!bounds.contains(x)) { continue; }
+                        if (comp(x, p_lo)) { ++local.below; }
+                        if (!comp(p_hi, x)) { ++local.up_to; }
+                    }
+                    return local;
+                },
+                [](counts lhs, counts rhs) {
+                    return counts{lhs.below + rhs.below, lhs.up_to + rhs.up_to};
+                });
+            // Narrow the bounds to the band that holds the target
+            long prev_candidates = num_candidates;
+            if (rank < c.below) {
+                bounds.has_hi = true; bounds.hi_strict = true; bounds.hi = p_lo;
+                num_candidates = c.below;
+            } else if (rank < c.up_to) {
+                // All of the candidates in the band are equal
+                if (!comp(p_lo, p_hi)) { return p_lo; }
+                bounds.has_lo = true; bounds.lo_strict = false; bounds.lo = p_lo;
+                bounds.has_hi = true; bounds.hi_strict = false; bounds.hi = p_hi;
+                rank -= c.below;
+                num_candidates = c.up_to - c.below;
+            } else {
+                bounds.has_lo = true; bounds.lo_strict = true; bounds.lo = p_hi;
+                rank -= c.up_to;
+                num_candidates -= c.up_to;
+            }
+            // Bad sample, don't try again
+            if (num_candidates == prev_candidates) { force_gather = true; }
+        }
+    }
+}
+
+} // end namespace emu::parallel
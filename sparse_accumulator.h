@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "intrinsics.h"
+#include "out_of_memory.h"
+#include "replicated.h"
+
+namespace emu {
+
+/**
+ * Sparse accumulator (SPA): a dense array of values indexed by [0, n) plus a
+ * list of the indices that have been touched. Used to merge sparse vectors,
+ * i.e. to compute one row of a sparse matrix product or to aggregate over a
+ * neighborhood, without hashing or sorting.
+ *
+ * All storage is allocated with mw_localmalloc on the nodelet that holds the
+ * accumulator object, so accumulating never migrates. clear() only resets the
+ * entries that were touched, so the accumulator can be reused for every row
+ * at a cost proportional to the row, not to n.
+ *
+ * The indices are split into num_partitions contiguous ranges, each with its
+ * own touched list and count. Threads that own different partitions can call
+ * accumulate(), for_each(p, f) and clear(p) at the same time without atomics.
+ * Threads that share a partition must use atomic_accumulate() instead.
+ *
+ * To keep one accumulator per nodelet, allocate it as
+ * @c new emu::repl_deep<emu::sparse_accumulator<T>>(n, num_partitions); each
+ * thread then uses the copy on its own nodelet.
+ *
+ * @tparam T Value type. atomic_accumulate() requires a 64-bit type.
+ */
+template<class T>
+class sparse_accumulator
+{
+private:
+    long n_;
+    long num_partitions_;
+    // Number of indices in each partition (the last one may be smaller)
+    long partition_size_;
+    // Dense values, T{} for entries that are not touched
+    T* values_;
+    // Nonzero for entries that are touched
+    long* marks_;
+    // Touched indices, in the order they were first touched. Partition p
+    // appends to its own range, starting at p * partition_size_
+    long* touched_;
+    // Number of touched entries in each partition
+    long* counts_;
+
+    template<class U>
+    U*
+    allocate(long n)
+    {
+        auto ptr = reinterpret_cast<U*>(mw_localmalloc(sizeof(U) * n, this));
+        if (!ptr) { EMU_OUT_OF_MEMORY(sizeof(U) * n); }
+        return ptr;
+    }
+
+    // Marks entry i as touched and appends it to its partition's list
+    void
+    touch(long i)
+    {
+        long p = partition_of(i);
+        marks_[i] = 1;
+        touched_[p * partition_size_ + counts_[p]++] = i;
+    }
+
+public:
+    typedef T value_type;
+
+    /**
+     * Constructs an empty accumulator
+     * @param n Number of indices, all indices must be in [0, n)
+     * @param num_partitions Number of contiguous index ranges that can be
+     * updated independently
+     */
+    explicit sparse_accumulator(long n, long num_partitions = 1)
+    : n_(n)
+    , num_partitions_(std::max(num_partitions, 1L))
+    , partition_size_(
+        std::max((n + num_partitions_ - 1) / num_partitions_, 1L))
+    , values_(allocate<T>(std::max(n, 1L)))
+    , marks_(allocate<long>(std::max(n, 1L)))
+    , touched_(allocate<long>(std::max(n, 1L)))
+    , counts_(allocate<long>(num_partitions_))
+    {
+        std::fill(values_, values_ + n_, T{});
+        std::fill(marks_, marks_ + n_, 0L);
+        std::fill(counts_, counts_ + num_partitions_, 0L);
+    }
+
+    sparse_accumulator(const sparse_accumulator&) = delete;
+    sparse_accumulator& operator=(const sparse_accumulator&) = delete;
+
+    ~sparse_accumulator()
+    {
+        mw_localfree(values_);
+        mw_localfree(marks_);
+        mw_localfree(touched_);
+        mw_localfree(counts_);
+    }
+
+    // Number of indices
+    long capacity() const { return n_; }
+    long num_partitions() const { return num_partitions_; }
+    // Partition that holds index i
+    long partition_of(long i) const { return i / partition_size_; }
+
+    // Number of touched entries in partition p
+    long size(long p) const { return counts_[p]; }
+    // Number of touched entries
+    long size() const
+    {
+        long total = 0;
+        for (long p = 0; p < num_partitions_; ++p) { total += counts_[p]; }
+        return total;
+    }
+    bool empty() const { return size() == 0; }
+
+    bool contains(long i) const { return marks_[i] != 0; }
+    // Value of entry i, T{} if it has not been touched
+    const T& operator[] (long i) const { return values_[i]; }
+
+    /**
+     * Combines value into entry i: the first value is stored as is, later
+     * values are combined with binary_op(current, value). Not safe to call
+     * concurrently with other updates to the same partition.
+     */
+    template<class BinaryOp = std::plus<>>
+    void
+    accumulate(long i, const T& value, BinaryOp binary_op = std::plus<>())
+    {
+        if (!marks_[i]) {
+            touch(i);
+            values_[i] = value;
+        } else {
+            values_[i] = binary_op(values_[i], value);
+        }
+    }
+
+    /**
+     * Adds value to entry i. Safe to call from many threads at once, even
+     * with the same index: the first thread to touch an entry appends it to
+     * its partition's list, and every thread adds its value atomically.
+     */
+    void
+    atomic_accumulate(long i, T value)
+    {
+        if (atomic_cas(&marks_[i], 0L, 1L) == 0L) {
+            long p = partition_of(i);
+            touched_[p * partition_size_ + atomic_addms(&counts_[p], 1)] = i;
+        }
+        emu::atomic_accumulate(&values_[i], value);
+    }
+
+    // Calls f(i, value) for each touched entry in partition p, in the order
+    // they were touched
+    template<class Function>
+    void
+    for_each(long p, Function f) const
+    {
+        const long* touched = touched_ + p * partition_size_;
+        for (long k = 0; k < counts_[p]; ++k) {
+            long i = touched[k];
+            f(i, values_[i]);
+        }
+    }
+
+    // Calls f(i, value) for each touched entry, one partition at a time
+    template<class Function>
+    void
+    for_each(Function f) const
+    {
+        for (long p = 0; p < num_partitions_; ++p) { for_each(p, f); }
+    }
+
+    /**
+     * Copies the touched entries to indices_out and values_out, one
+     * partition at a time
+     * @return The number of entries copied
+     */
+    template<class IndexIt, class ValueIt>
+    long
+    copy(IndexIt indices_out, ValueIt values_out) const
+    {
+        long count = 0;
+        for_each([&](long i, const T& value) {
+            *indices_out++ = i;
+            *values_out++ = value;
+            ++count;
+        });
+        return count;
+    }
+
+    // Sorts the touched list of partition p
+    void
+    sort(long p)
+    {
+        long* touched = touched_ + p * partition_size_;
+        std::sort(touched, touched + counts_[p]);
+    }
+
+    // Sorts every touched list. Partitions are contiguous ranges, so for_each
+    // and copy then visit indices in order.
+    void
+    sort()
+    {
+        for (long p = 0; p < num_partitions_; ++p) { sort(p); }
+    }
+
+    // Resets the touched entries of partition p. Runs in O(size(p)).
+    void
+    clear(long p)
+    {
+        const long* touched = touched_ + p * partition_size_;
+        for (long k = 0; k < counts_[p]; ++k) {
+            long i = touched[k];
+            values_[i] = T{};
+            marks_[i] = 0;
+        }
+        counts_[p] = 0;
+    }
+
+    // Resets the touched entries. Runs in O(size()), not O(capacity()).
+    void
+    clear()
+    {
+        for (long p = 0; p < num_partitions_; ++p) { clear(p); }
+    }
+};
+
+} // end namespace emu
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <algorithm>
+#include <type_traits>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "execution_policy.h"
+#include "intrinsics.h"
+#include "out_of_memory.h"
+#include "replicated.h"
+#include "striped_array.h"
+#include "repl_array.h"
+#include "for_each.h"
+
+namespace emu {
+
+/**
+ * Distributed sparse matrix in compressed sparse row (CSR) format.
+ *
+ * Rows are striped across nodelets like a striped_array: row r is on nodelet
+ * (r % nodelets()). The column indices and values of each row are stored on
+ * the same nodelet as the row, in one local allocation per nodelet, so a
+ * thread working on a row never migrates to read its nonzeros.
+ *
+ * Vectors used with the matrix should be striped_arrays that start on
+ * nodelet 0, so that y[r] and x[r] are on the same nodelet as row r.
+ *
+ * @tparam T Value type. Must be a 64-bit type (generally @c long or @c double)
+ */
+template<class T>
+class csr_matrix
+{
+    static_assert(sizeof(T) == 8, "csr_matrix can only hold 64-bit data types");
+private:
+    repl<long> num_rows_;
+    repl<long> num_cols_;
+    repl<long> nnz_;
+    // Row indices, so the row loop works with every policy
+    // (the unroll policies pass elements by value)
+    striped_array<long> row_ids_;
+    // Number of nonzeros in each row
+    striped_array<long> row_nnz_;
+    // Pointers to the column indices and values of each row
+    striped_array<long*> row_cols_;
+    striped_array<T*> row_vals_;
+    // Local storage for the nonzeros on each nodelet
+    striped_array<long*> nlet_cols_;
+    striped_array<T*> nlet_vals_;
+
+    // Copies the rows owned by nlet into local storage
+    void
+    copy_local_rows(long nlet,
+        const long* offsets, const long* cols, const T* vals)
+    {
+        long local_nnz = 0;
+        for (long r = nlet; r < num_rows_; r += nodelets()) {
+            local_nnz += offsets[r + 1] - offsets[r];
+        }
+        // Allocate next to the nodelet's first row
+        // Always allocate at least one element so every nodelet has storage
+        long n = local_nnz > 0 ? local_nnz : 1;
+        auto local_cols = reinterpret_cast<long*>(
+            mw_localmalloc(sizeof(long) * n, &nlet_cols_[nlet]));
+        auto local_vals = reinterpret_cast<T*>(
+            mw_localmalloc(sizeof(T) * n, &nlet_cols_[nlet]));
+        if (!local_cols || !local_vals) {
+            EMU_OUT_OF_MEMORY((sizeof(long) + sizeof(T)) * n);
+        }
+        nlet_cols_[nlet] = local_cols;
+        nlet_vals_[nlet] = local_vals;
+        for (long r = nlet; r < num_rows_; r += nodelets()) {
+            long degree = offsets[r + 1] - offsets[r];
+            row_ids_[r] = r;
+            row_nnz_[r] = degree;
+            row_cols_[r] = local_cols;
+            row_vals_[r] = local_vals;
+            for (long k = 0; k < degree; ++k) {
+                local_cols[k] = cols[offsets[r] + k];
+                local_vals[k] = vals[offsets[r] + k];
+            }
+            local_cols += degree;
+            local_vals += degree;
+        }
+    }
+
+public:
+    typedef T value_type;
+
+    // Default constructor
+    csr_matrix() : num_rows_(0), num_cols_(0), nnz_(0) {}
+
+    /**
+     * Constructs a distributed copy of a matrix in CSR format
+     * @param num_rows Number of rows
+     * @param num_cols Number of columns
+     * @param offsets Row offsets (num_rows + 1 elements)
+     * @param cols Column index of each nonzero
+     * @param vals Value of each nonzero
+     */
+    csr_matrix(long num_rows, long num_cols,
+        const long* offsets, const long* cols, const T* vals)
+    : num_rows_(num_rows)
+    , num_cols_(num_cols)
+    , nnz_(offsets[num_rows] - offsets[0])
+    , row_ids_(num_rows)
+    , row_nnz_(num_rows)
+    , row_cols_(num_rows)
+    , row_vals_(num_rows)
+    , nlet_cols_(nodelets())
+    , nlet_vals_(nodelets())
+    {
+        // Each nodelet copies its own rows in parallel
+        long** nlet_cols = nlet_cols_.data();
+        parallel::for_each(par, nlet_cols, nlet_cols + nodelets(),
+            [=](long*& local) {
+                copy_local_rows(&local - nlet_cols, offsets, cols, vals);
+            });
+    }
+
+    ~csr_matrix()
+    {
+        for (long nlet = 0; nlet < nlet_cols_.size(); ++nlet) {
+            mw_localfree(nlet_cols_[nlet]);
+            mw_localfree(nlet_vals_[nlet]);
+        }
+    }
+
+    friend void
+    swap(csr_matrix& first, csr_matrix& second)
+    {
+        using std::swap;
+        swap(first.num_rows_, second.num_rows_);
+        swap(first.num_cols_, second.num_cols_);
+        swap(first.nnz_, second.nnz_);
+        swap(first.row_ids_, second.row_ids_);
+        swap(first.row_nnz_, second.row_nnz_);
+        swap(first.row_cols_, second.row_cols_);
+        swap(first.row_vals_, second.row_vals_);
+        swap(first.nlet_cols_, second.nlet_cols_);
+        swap(first.nlet_vals_, second.nlet_vals_);
+    }
+
+    // Copy constructor
+    csr_matrix(const csr_matrix& other) = delete;
+
+    // Assignment operator (using copy-and-swap idiom)
+    csr_matrix& operator= (csr_matrix other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+
+    // Move constructor (using copy-and-swap idiom)
+    csr_matrix(csr_matrix&& other) noexcept : csr_matrix()
+    {
+        swap(*this, other);
+    }
+
+    long num_rows() const { return num_rows_; }
+    long num_cols() const { return num_cols_; }
+    long nnz() const { return nnz_; }
+
+    // Striped array of row indices (0, 1, 2, ...)
+    const long* row_ids() const { return row_ids_.data(); }
+    // Number of nonzeros in row r
+    long row_nnz(long r) const { return row_nnz_[r]; }
+    // Column indices of the nonzeros in row r
+    const long* row_cols(long r) const { return row_cols_[r]; }
+    // Values of the nonzeros in row r
+    const T* row_vals(long r) const { return row_vals_[r]; }
+
+    // Striped arrays of per-row data, for capturing in worker functions
+    long* const* row_cols_data() const { return row_cols_.data(); }
+    T* const* row_vals_data() const { return row_vals_.data(); }
+    const long* row_nnz_data() const { return row_nnz_.data(); }
+};
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+// y = A * x, where x is any array that is valid on every nodelet
+template<class Policy, class T>
+void
+spmv_pull(Policy policy, const csr_matrix<T>& A, const T* x, T* y)
+{
+    auto row_nnz = A.row_nnz_data();
+    auto row_cols = A.row_cols_data();
+    auto row_vals = A.row_vals_data();
+    const long* rows = A.row_ids();
+    emu::parallel::for_each(policy, rows, rows + A.num_rows(), [=](long r) {
+        // Row r and its nonzeros are local, only x[c] may be remote
+        const long* cols = row_cols[r];
+        const T* vals = row_vals[r];
+        T sum = 0;
+        for (long k = 0; k < row_nnz[r]; ++k) {
+            sum += vals[k] * x[cols[k]];
+        }
+        y[r] = sum;
+    });
+}
+
+} // end namespace detail
+
+/**
+ * Pull-mode sparse matrix-vector multiply, y = A * x.
+ *
+ * Each row is processed on its own nodelet and writes y[r] locally. Reading
+ * x[c] migrates to the nodelet that holds it; pass a replicated copy of x
+ * to avoid that.
+ *
+ * @param x Striped vector with A.num_cols() elements
+ * @param y Striped vector with A.num_rows() elements
+ */
+template<class Policy, class T,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<Policy>, int> = 0
+>
+void
+spmv(Policy policy, const csr_matrix<T>& A,
+    const striped_array<T>& x, striped_array<T>& y)
+{
+    detail::spmv_pull(policy, A, x.data(), y.data());
+}
+
+/**
+ * Pull-mode sparse matrix-vector multiply with a replicated x. Every x[c] read
+ * is local, at the cost of storing x on every nodelet. Use this when x fits
+ * in each nodelet's memory; see replicate().
+ */
+template<class Policy, class T,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<Policy>, int> = 0
+>
+void
+spmv(Policy policy, const csr_matrix<T>& A,
+    const repl_array<T>& x, striped_array<T>& y)
+{
+    // View-0 pointer resolves to the local copy on each nodelet
+    detail::spmv_pull(policy, A, x.data(), y.data());
+}
+
+/**
+ * Push-mode sparse matrix-vector multiply, y += transpose(A) * x.
+ *
+ * Each row r is processed on its own nodelet, reads x[r] locally, and adds
+ * A(r, c) * x[r] to y[c]. Updates to integer vectors use remote adds, which
+ * don't migrate the thread. Floating-point updates use compare-and-swap.
+ *
+ * @param x Striped vector with A.num_rows() elements
+ * @param y Striped vector with A.num_cols() elements
+ */
+template<class Policy, class T,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<Policy>, int> = 0
+>
+void
+spmv_transpose_add(Policy policy, const csr_matrix<T>& A,
+    const striped_array<T>& x, striped_array<T>& y)
+{
+    auto row_nnz = A.row_nnz_data();
+    auto row_cols = A.row_cols_data();
+    auto row_vals = A.row_vals_data();
+    const long* rows = A.row_ids();
+    const T* x_ptr = x.data();
+    T* y_ptr = y.data();
+    emu::parallel::for_each(policy, rows, rows + A.num_rows(), [=](long r) {
+        const long* cols = row_cols[r];
+        const T* vals = row_vals[r];
+        T x_r = x_ptr[r];
+        for (long k = 0; k < row_nnz[r]; ++k) {
+            atomic_accumulate(&y_ptr[cols[k]], vals[k] * x_r);
+        }
+    });
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class T, class Vector>
+void
+spmv(const csr_matrix<T>& A, const Vector& x, striped_array<T>& y)
+{
+    spmv(emu::default_policy, A, x, y);
+}
+
+template<class T>
+void
+spmv_transpose_add(const csr_matrix<T>& A,
+    const striped_array<T>& x, striped_array<T>& y)
+{
+    spmv_transpose_add(emu::default_policy, A, x, y);
+}
+
+/**
+ * Copies a striped vector to every nodelet of a replicated array, i.e. to
+ * prepare x for spmv().
+ * @param x Source vector
+ * @param x_repl Destination, must have the same size as x
+ */
+template<class T>
+void
+replicate(const striped_array<T>& x, repl_array<T>& x_repl)
+{
+    const T* src = x.data();
+    // Spawn a thread on each nodelet to fill its copy
+    for (long nlet = 0; nlet < nodelets(); ++nlet) {
+        T* local = x_repl.get_nth(nlet);
+        cilk_migrate_hint(local);
+        cilk_spawn std::copy(src, src + x.size(), local);
+    }
+    cilk_sync;
+}
+
+} // end namespace emu::parallel
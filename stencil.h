@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <type_traits>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "execution_policy.h"
+#include "out_of_memory.h"
+#include "thread_budget.h"
+#include "block_array.h"
+
+/*
+ * Stencil (neighborhood) loops over block-cyclic arrays.
+ *
+ * Elements in the interior of a block read their neighbors in place. For the
+ * elements near either end of a block, the neighbors in the adjacent blocks
+ * are copied into a local ghost buffer, so each sweep does one bulk copy per
+ * block boundary instead of a migration per remote neighbor.
+ */
+
+namespace emu::parallel {
+namespace detail {
+
+/**
+ * Copies the elements with global indices [first - halo, last + halo) into
+ * buf, walking the underlying array one block at a time. Positions outside
+ * the range [begin, end) are filled with boundary.
+ */
+template<class T, long BlockSize, class U>
+void
+fill_ghost_buffer(
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    long first, long last, long halo, const U& boundary, U* buf
+) {
+    long lo = std::max(first - halo, begin.index());
+    long hi = std::min(last + halo, end.index());
+    // Pad the edges of the range
+    std::fill(buf, buf + (lo - (first - halo)), boundary);
+    std::fill(buf + (hi - (first - halo)), buf + (last - first + 2 * halo),
+        boundary);
+    // Bulk copy, one block at a time
+    U* dst = buf + (lo - (first - halo));
+    for (auto it = begin + (lo - begin.index()); it.index() < hi;) {
+        long n = std::min(it.block_remaining(), hi - it.index());
+        std::copy(it.ptr(), it.ptr() + n, dst);
+        dst += n;
+        it += n;
+    }
+}
+
+// Calls worker(window, i) for n consecutive elements starting at index first
+template<class U, class StencilFunction>
+void
+stencil_sweep(const U* window, long first, long n, StencilFunction worker)
+{
+    for (long i = 0; i < n; ++i) {
+        worker(window + i, first + i);
+    }
+}
+
+// Same as above, but runs in a spawned thread that counts against the budget
+template<class U, class StencilFunction>
+void
+stencil_grain(const U* window, long first, long n, StencilFunction worker)
+{
+    thread_budget_guard guard;
+    stencil_sweep(window, first, n, worker);
+}
+
+/**
+ * Sweeps the elements of block [first, last) that are within halo of either
+ * end of the block, copying just those elements and their neighbors into
+ * slot, which must hold 6 * halo elements. Runs in a spawned thread, so each
+ * block fills its own part of the ghost buffer.
+ */
+template<class T, long BlockSize, class U, class StencilFunction>
+void
+stencil_block_edges(
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    long first, long last, long halo, U boundary, U* slot,
+    StencilFunction worker
+) {
+    thread_budget_guard guard;
+    if (last - first <= 2 * halo) {
+        // Every element is near an edge, copy the whole block
+        fill_ghost_buffer(begin, end, first, last, halo, boundary, slot);
+        stencil_sweep(slot + halo, first, last - first, worker);
+    } else {
+        U* left = slot;
+        fill_ghost_buffer(begin, end, first, first + halo, halo, boundary, left);
+        stencil_sweep(left + halo, first, halo, worker);
+        U* right = slot + 3 * halo;
+        fill_ghost_buffer(begin, end, last - halo, last, halo, boundary, right);
+        stencil_sweep(right + halo, last - halo, halo, worker);
+    }
+}
+
+/**
+ * Stencil over the blocks of [begin, end) on nlet. Elements whose neighbors
+ * all lie in the same block read their window in place. For the halo
+ * elements at each end of a block, a spawned thread copies them and their
+ * neighbors into that block's slot of a local ghost buffer, so the only bulk
+ * copies are the 2 * halo remote neighbors of each block, and they run in
+ * parallel.
+ */
+template<class Policy, class T, long BlockSize, class U,
+    class StencilFunction>
+void
+stencil_nodelet(
+    Policy policy, long nlet,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    long halo, U boundary, StencilFunction worker
+) {
+    long block_size = begin.block_size();
+    long last_block = (end.index() - 1) / block_size;
+    long first_block = next_block_on(nlet, begin.index() / block_size);
+
+    // Allocate a slot for the edges of each local block, next to the first
+    // local element
+    U* buf = nullptr;
+    if (halo > 0) {
+        long num_blocks = 0;
+        for (long b = first_block; b <= last_block; b += nodelets()) {
+            ++num_blocks;
+        }
+        long buf_size = num_blocks * 6 * halo;
+        auto local = begin
+            + (first_on_nodelet(nlet, begin, end) - begin.index());
+        buf = reinterpret_cast<U*>(
+            mw_localmalloc(sizeof(U) * buf_size, local.ptr()));
+        if (!buf) { EMU_OUT_OF_MEMORY(sizeof(U) * buf_size); }
+    }
+
+    // Sweep, spawning a thread for the edges of each block and for each grain
+    // of its interior
+    long grain = local_block_grain(policy, nlet, begin, end);
+    U* slot = buf;
+    for (long b = first_block; b <= last_block; b += nodelets()) {
+        long first = std::max(b * block_size, begin.index());
+        long last = std::min((b + 1) * block_size, end.index());
+        if (halo > 0) {
+            cilk_spawn stencil_block_edges(begin, end, first, last,
+                halo, boundary, slot, worker);
+            slot += 6 * halo;
+        }
+        const T* block = (begin + (first - begin.index())).ptr();
+        for (long i = first + halo; i < last - halo; i += grain) {
+            long n = std::min(grain, last - halo - i);
+            cilk_spawn stencil_grain(block + (i - first), i, n, worker);
+        }
+    }
+    // Ghost buffer must stay valid until all the grains are done
+    cilk_sync;
+    if (buf) { mw_localfree(buf); }
+}
+
+} // end namespace detail
+
+/**
+ * Calls worker(window, i) for each element i of the block-cyclic range
+ * [begin, end), where window points to a local copy of element i, and
+ * window[-halo] through window[halo] hold its neighbors. Neighbors outside
+ * the range read as boundary.
+ *
+ * The window may point into the array itself, so the worker must not modify
+ * [begin, end). Write the results to a separate array instead (ideally
+ * another block_array with the same block size, so the writes are local).
+ *
+ * For a 2D grid stored in row-major order with row length w, use a block size
+ * that is a multiple of w and a halo of r * w to see r rows above and below.
+ *
+ * @param halo Number of neighbors on each side of an element
+ * @param boundary Value of neighbors outside the range
+ */
+template<class Policy, class T, long BlockSize, class StencilFunction,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<Policy>, int> = 0
+>
+void
+stencil_for_each(
+    Policy policy,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    long halo, std::remove_const_t<T> boundary, StencilFunction worker
+) {
+    using U = std::remove_const_t<T>;
+    static_assert(std::is_trivially_copyable_v<U>,
+        "Ghost buffers are allocated with mw_localmalloc");
+    using serial_policy = remove_parallel_t<Policy>;
+    if (end - begin == 0) {
+        return;
+    } else if constexpr (std::is_same_v<serial_policy, Policy>) {
+        // Reuse a single ghost buffer for each block, in order
+        long buf_size = begin.block_size() + 2 * halo;
+        auto buf = reinterpret_cast<U*>(
+            mw_localmalloc(sizeof(U) * buf_size, begin.ptr()));
+        if (!buf) { EMU_OUT_OF_MEMORY(sizeof(U) * buf_size); }
+        for (long first = begin.index(); first < end.index();) {
+            long n = std::min((begin + (first - begin.index())).block_remaining(),
+                end.index() - first);
+            detail::fill_ghost_buffer(begin, end, first, first + n,
+                halo, boundary, buf);
+            detail::stencil_sweep(buf + halo, first, n, worker);
+            first += n;
+        }
+        mw_localfree(buf);
+    } else if (thread_budget_exhausted(policy)) {
+        // Nodelet is saturated, run serially instead
+        stencil_for_each(serial_policy(), begin, end, halo, boundary, worker);
+    } else {
+        detail::block_spawn(policy, 0, nodelets(), begin, end, [=](long nlet) {
+            detail::stencil_nodelet(
+                policy, nlet, begin, end, halo, boundary, worker);
+        });
+    }
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class T, long BlockSize, class StencilFunction>
+void
+stencil_for_each(
+    default_policy_t,
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    long halo, std::remove_const_t<T> boundary, StencilFunction worker
+) {
+    visit_default_policy</*AllowDynamic*/false>([&](auto policy) {
+        stencil_for_each(policy, begin, end, halo, boundary, worker);
+    });
+}
+
+template<class T, long BlockSize, class StencilFunction>
+void
+stencil_for_each(
+    block_iterator<T, BlockSize> begin, block_iterator<T, BlockSize> end,
+    long halo, std::remove_const_t<T> boundary, StencilFunction worker
+) {
+    stencil_for_each(emu::default_policy, begin, end, halo, boundary, worker);
+}
+
+} // end namespace emu::parallel
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "pointer_manipulation.h"
+#include "nodelets.h"
+
+namespace emu {
+
+/**
+ * Divides unsigned 64-bit integers by a divisor that is fixed at run time,
+ * using a precomputed magic number so that each division is a multiply-high
+ * and a shift. See Granlund and Montgomery, "Division by Invariant Integers
+ * using Multiplication".
+ */
+class fast_divider
+{
+private:
+    unsigned long divisor_;
+    unsigned long magic_;
+    unsigned shift_;
+    // Whether the magic number needs an extra add (doesn't fit in 64 bits)
+    bool add_;
+
+    // High 64 bits of a 64x64-bit product
+    static unsigned long
+    mulhi(unsigned long a, unsigned long b)
+    {
+#ifdef __SIZEOF_INT128__
+        return static_cast<unsigned long>(
+            (static_cast<unsigned __int128>(a) * b) >> 64);
+#else
+        unsigned long a_lo = a & 0xFFFFFFFFUL, a_hi = a >> 32;
+        unsigned long b_lo = b & 0xFFFFFFFFUL, b_hi = b >> 32;
+        unsigned long lo_lo = a_lo * b_lo;
+        unsigned long hi_lo = a_hi * b_lo;
+        unsigned long lo_hi = a_lo * b_hi;
+        unsigned long cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFUL) + lo_hi;
+        return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+    }
+
+    // Computes (hi * 2^64) / d, assuming hi < d. Returns the remainder in rem
+    static unsigned long
+    divide_128(unsigned long hi, unsigned long d, unsigned long& rem)
+    {
+#ifdef __SIZEOF_INT128__
+        auto n = static_cast<unsigned __int128>(hi) << 64;
+        rem = static_cast<unsigned long>(n % d);
+        return static_cast<unsigned long>(n / d);
+#else
+        // Shift-subtract long division, one bit at a time
+        unsigned long q = 0;
+        for (int i = 0; i < 64; ++i) {
+            bool carry = hi >> 63;
+            hi <<= 1;
+            q <<= 1;
+            if (carry || hi >= d) { hi -= d; q |= 1; }
+        }
+        rem = hi;
+        return q;
+#endif
+    }
+
+public:
+    // Empty divider with a divisor of zero, which must be assigned before use.
+    // Constant-initialized, so replicated copies start out empty on every
+    // nodelet.
+    constexpr fast_divider()
+    : divisor_(0), magic_(0), shift_(0), add_(false) {}
+
+    explicit fast_divider(unsigned long divisor)
+    : divisor_(divisor), magic_(0), shift_(0), add_(false)
+    {
+        unsigned floor_log2 = 63 - __builtin_clzl(divisor);
+        if ((divisor & (divisor - 1)) == 0) {
+            // Power of two, just shift
+            shift_ = floor_log2;
+            return;
+        }
+        unsigned long rem;
+        unsigned long m = divide_128(1UL << floor_log2, divisor, rem);
+        unsigned long e = divisor - rem;
+        if (e < (1UL << floor_log2)) {
+            // The magic number fits in 64 bits
+            shift_ = floor_log2;
+        } else {
+            // Needs one more bit, use the add-and-shift fixup
+            m += m;
+            unsigned long twice_rem = rem + rem;
+            if (twice_rem >= divisor || twice_rem < rem) { m += 1; }
+            shift_ = floor_log2;
+            add_ = true;
+        }
+        magic_ = m + 1;
+    }
+
+    unsigned long divisor() const { return divisor_; }
+
+    // Returns n / divisor
+    unsigned long
+    divide(unsigned long n) const
+    {
+        if (magic_ == 0) { return n >> shift_; }
+        unsigned long q = mulhi(magic_, n);
+        if (add_) {
+            return (((n - q) >> 1) + q) >> shift_;
+        } else {
+            return q >> shift_;
+        }
+    }
+
+    // Returns n % divisor
+    unsigned long
+    modulo(unsigned long n) const
+    {
+        return n - divide(n) * divisor_;
+    }
+};
+
+namespace detail {
+// Divides by nodelets(). There is a copy on each nodelet, so using it never
+// migrates. Empty until init_nodelet_divider() runs.
+inline replicated fast_divider the_nodelet_divider;
+} // end namespace detail
+
+// Computes the divider for nodelets() and writes it to every nodelet. Called
+// by set_runtime_config(); must not run while stripe_layout is in use.
+inline void
+init_nodelet_divider()
+{
+    fast_divider divider(nodelets());
+    for (long nlet = 0; nlet < NODELETS(); ++nlet) {
+        *pmanip::get_nth(&detail::the_nodelet_divider, nlet) = divider;
+    }
+}
+
+// Returns the local copy of the divider for nodelets(). Its divisor is zero
+// if init_nodelet_divider() has not been called yet.
+inline const fast_divider&
+nodelet_divider()
+{
+    return detail::the_nodelet_divider;
+}
+
+/**
+ * Describes how the elements of a striped array (mw_malloc1dlong) are laid
+ * out across nodelets: element i is on nodelet (i % nodelets()), at index
+ * (i / nodelets()) within that nodelet's stripe.
+ *
+ * If the array starts on a nodelet other than zero (see striped_array), the
+ * element positions are shifted by the first nodelet. Local indices are
+ * relative to the start of the underlying allocation.
+ *
+ * Division by the nodelet count uses the replicated nodelet_divider(), or
+ * shifts and masks if the nodelet count is known at compile time
+ * (EMU_CXX_NODELETS). Before init_runtime_config() has filled in the divider,
+ * it falls back to a hardware divide. A layout is just two longs, so it is
+ * cheap to build on every call.
+ */
+class stripe_layout
+{
+private:
+    // Total number of elements
+    long size_;
+    // Nodelet that holds the first element
+    long first_;
+
+    long div(long i) const
+    {
+        if constexpr (nodelets_are_constant) {
+            return nlet_div(i);
+        } else {
+            const fast_divider& divider = nodelet_divider();
+            if (divider.divisor() == 0) { return i / nodelets(); }
+            return static_cast<long>(divider.divide(i));
+        }
+    }
+
+    long mod(long i) const
+    {
+        if constexpr (nodelets_are_constant) {
+            return nlet_mod(i);
+        } else {
+            const fast_divider& divider = nodelet_divider();
+            if (divider.divisor() == 0) { return i % nodelets(); }
+            return static_cast<long>(divider.modulo(i));
+        }
+    }
+
+    // Number of elements on nlet with a global index less than i
+    long count_below(long nlet, long i) const
+    {
+        return i > nlet ? div(i - nlet + nodelets() - 1) : 0;
+    }
+
+public:
+    // Position of an element within the striped array
+    struct position
+    {
+        // Nodelet that holds the element
+        long nlet;
+        // Index of the element within the nodelet's stripe
+        long local;
+    };
+
+    explicit stripe_layout(long size = 0, long first_nlet = 0)
+    : size_(size)
+    , first_(first_nlet)
+    {}
+
+    long size() const { return size_; }
+
+    long first_nodelet() const { return first_; }
+
+    // Returns the nodelet that holds element i
+    long nodelet(long i) const { return mod(i + first_); }
+
+    // Returns the index of element i within its nodelet's stripe
+    long local_index(long i) const { return div(i + first_); }
+
+    // Returns the nodelet and local index of element i
+    position locate(long i) const
+    {
+        long local = div(i + first_);
+        return position{i + first_ - nlet_mul(local), local};
+    }
+
+    // Inverse of locate(): global index of the local'th element on nlet
+    long global_index(long nlet, long local) const
+    {
+        return nlet_mul(local) + nlet - first_;
+    }
+
+    long global_index(position pos) const
+    {
+        return global_index(pos.nlet, pos.local);
+    }
+
+    // Returns the number of elements on nlet
+    long count(long nlet) const
+    {
+        return count_below(nlet, size_ + first_) - count_below(nlet, first_);
+    }
+
+    // Range of local indices within a nodelet's stripe
+    struct local_range_t
+    {
+        long first;
+        long last;
+    };
+
+    /**
+     * Returns the local index range [first, last) on nlet of the elements
+     * in the global range [begin, end)
+     */
+    local_range_t local_range(long nlet, long begin, long end) const
+    {
+        return local_range_t{
+            count_below(nlet, begin + first_),
+            count_below(nlet, end + first_)
+        };
+    }
+};
+
+} // end namespace emu
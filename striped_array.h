@@ -1,13 +1,57 @@
 #pragma once
 
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <emu_c_utils/emu_c_utils.h>
 
 #include "replicated.h"
+#include "intrinsics.h"
 #include "out_of_memory.h"
-//#include "copy.h"
+#include "stripe_layout.h"
+#include "for_each.h"
 
 namespace emu {
 
+/**
+ * Tag type for choosing the first nodelet of a striped allocation by
+ * rotating through the nodelets. Spreads many small arrays (and their
+ * remainder elements) evenly across the system.
+ */
+struct rotate_nodelets_t {};
+inline constexpr rotate_nodelets_t rotate_nodelets {};
+
+/**
+ * Tag type for choosing the first nodelet of a striped allocation explicitly,
+ * i.e. striped_array<long>(n, starting_nodelet(3))
+ */
+struct starting_nodelet
+{
+    long nlet;
+    explicit starting_nodelet(long nlet) : nlet(nlet) {}
+};
+
+/**
+ * Tag type for skipping element construction. Faster for large arrays that
+ * will be overwritten anyway, but elements of a non-trivial type must be
+ * constructed (i.e. with placement new) before the array is destroyed.
+ */
+struct uninitialized_t {};
+inline constexpr uninitialized_t uninitialized {};
+
+namespace detail {
+// Counter used to pick the first nodelet when rotating
+inline long the_next_first_nodelet = 0;
+} // end namespace detail
+
+// Returns the first nodelet for the next rotated striped allocation
+inline long
+next_first_nodelet()
+{
+    long n = atomic_addms(&detail::the_next_first_nodelet, 1);
+    return nlet_mod(n);
+}
+
 /**
  * Encapsulates a striped array ( @c mw_malloc1dlong).
  * @tparam T Element type. Must be a 64-bit type (generally @c long or a pointer type).
@@ -19,30 +63,130 @@ class striped_array
 private:
     repl<long> n_;
     repl<T*> ptr_;
+    // Nodelet that holds the first element
+    repl<long> first_nlet_;
 
-    T* allocate(long size)
+    // Allocates an array where element 0 is on first_nlet
+    // Over-allocates by first_nlet elements and skips over them
+    T* allocate(long size, long first_nlet)
     {
         auto ptr = reinterpret_cast<T*>(
-            mw_malloc1dlong(static_cast<size_t>(size)));
-        if (!ptr) { EMU_OUT_OF_MEMORY(size * sizeof(long)); }
-        return ptr;
+            mw_malloc1dlong(static_cast<size_t>(size + first_nlet)));
+        if (!ptr) { EMU_OUT_OF_MEMORY((size + first_nlet) * sizeof(long)); }
+        return ptr + first_nlet;
+    }
+
+    void deallocate()
+    {
+        if (ptr_) { mw_free((void*)(ptr_ - first_nlet_)); }
+    }
+
+    /**
+     * Calls f(i, ptr + i) for each i in [first, last), in parallel. Each
+     * element is visited by a thread on the nodelet that holds it, so
+     * construction and destruction don't migrate.
+     */
+    template<class Function>
+    static void
+    for_each_element(T* ptr, long first, long last, Function f)
+    {
+        if (first >= last) { return; }
+        parallel::for_each(fixed, ptr + first, ptr + last,
+            [=](T& x) { f(&x - ptr, &x); });
+    }
+
+    // Default-initializes elements [first, last)
+    static void
+    construct(T* ptr, long first, long last)
+    {
+        if constexpr (!std::is_trivially_default_constructible_v<T>) {
+            for_each_element(ptr, first, last, [](long, T* x) { new (x) T; });
+        }
+    }
+
+    // Destroys elements [first, last)
+    static void
+    destroy(T* ptr, long first, long last)
+    {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for_each_element(ptr, first, last, [](long, T* x) { x->~T(); });
+        }
     }
 
 public:
     typedef T value_type;
 
     // Default constructor
-    striped_array() : n_(0), ptr_(nullptr) {};
+    striped_array() : n_(0), ptr_(nullptr), first_nlet_(0) {};
 
     /**
-     * Constructs a emu_striped_array<T>
+     * Constructs a emu_striped_array<T>, default-initializing each element
      * @param n Number of elements
      */
     explicit striped_array(long n)
+    : striped_array(n, starting_nodelet(0))
+    {}
+
+    /**
+     * Constructs a emu_striped_array<T> that starts on a chosen nodelet
+     * @param n Number of elements
+     * @param first Nodelet that will hold element 0
+     */
+    striped_array(long n, starting_nodelet first)
+    : striped_array(n, uninitialized, first)
+    {
+        construct(ptr_, 0, n_);
+    }
+
+    /**
+     * Constructs a emu_striped_array<T>, rotating the first nodelet
+     * @param n Number of elements
+     */
+    striped_array(long n, rotate_nodelets_t)
+    : striped_array(n, starting_nodelet(next_first_nodelet()))
+    {}
+
+    /**
+     * Constructs a emu_striped_array<T> without constructing the elements
+     * @param n Number of elements
+     */
+    striped_array(long n, uninitialized_t,
+        starting_nodelet first = starting_nodelet(0))
     : n_(n)
-    , ptr_(allocate(n))
+    , ptr_(allocate(n, first.nlet))
+    , first_nlet_(first.nlet)
     {}
 
+    /**
+     * Constructs a emu_striped_array<T> with n copies of value. Elements are
+     * copy-constructed in parallel on the nodelets that hold them.
+     * @param n Number of elements
+     * @param value Value to copy into each element
+     */
+    striped_array(long n, const T& value)
+    : striped_array(n, uninitialized)
+    {
+        T v = value;
+        for_each_element(ptr_, 0, n_, [=](long, T* x) { new (x) T(v); });
+    }
+
+    /**
+     * Constructs a emu_striped_array<T> with element i set to generator(i).
+     * The generator is called in parallel on the nodelet that holds each
+     * element, so it must be safe to call concurrently.
+     * @param n Number of elements
+     * @param generator Function that takes an index and returns a T
+     */
+    template<class Generator, std::enable_if_t<
+        std::is_invocable_v<Generator, long>
+        && !std::is_convertible_v<Generator, T>, int> = 0>
+    striped_array(long n, Generator generator)
+    : striped_array(n, uninitialized)
+    {
+        for_each_element(ptr_, 0, n_,
+            [=](long i, T* x) { new (x) T(generator(i)); });
+    }
+
     typedef T* iterator;
     typedef const T* const_iterator;
 
@@ -64,7 +208,8 @@ public:
     // Destructor
     ~striped_array()
     {
-        if (ptr_) { mw_free((void*)ptr_); }
+        if (ptr_) { destroy(ptr_, 0, n_); }
+        deallocate();
     }
 
     friend void
@@ -73,6 +218,7 @@ public:
         using std::swap;
         swap(first.n_, second.n_);
         swap(first.ptr_, second.ptr_);
+        swap(first.first_nlet_, second.first_nlet_);
     }
 
     // Copy constructor
@@ -93,7 +239,7 @@ public:
 
     // Shallow copy constructor (used for repl<T>)
     striped_array(const striped_array& other, shallow_copy)
-    : n_(other.n_), ptr_(other.ptr_) {}
+    : n_(other.n_), ptr_(other.ptr_), first_nlet_(other.first_nlet_) {}
 
     T&
     operator[] (long i)
@@ -109,20 +255,39 @@ public:
 
     long size() const { return n_; }
 
+    // Nodelet that holds element 0
+    long first_nodelet() const { return first_nlet_; }
+
+    // Describes which nodelet holds each element
+    stripe_layout layout() const { return stripe_layout(n_, first_nlet_); }
+
+    /**
+     * Changes the number of elements. New elements are default-initialized.
+     * When growing, existing elements are moved to the new allocation in
+     * parallel.
+     */
     void resize(long new_size)
     {
         // Do we need to reallocate?
         if (new_size > n_) {
-            // Allocate new array
-            auto new_ptr = allocate(new_size);
+            // Allocate new array, starting on the same nodelet
+            T* new_ptr = allocate(new_size, first_nlet_);
             if (ptr_) {
-                // Copy elements over into new array
-//                emu::parallel::copy(ptr_, ptr_ + n_, new_ptr);
+                // Move elements over into new array
+                // Both arrays start on the same nodelet, so this is all local
+                T* old_ptr = ptr_;
+                for_each_element(old_ptr, 0, n_, [=](long i, T* x) {
+                    new (new_ptr + i) T(std::move(*x));
+                    x->~T();
+                });
                 // Deallocate old array
-                mw_free(ptr_);
+                deallocate();
             }
+            construct(new_ptr, n_, new_size);
             // Save new pointer
             ptr_ = new_ptr;
+        } else {
+            destroy(ptr_, new_size, n_);
         }
         // Update size
         n_ = new_size;
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <emu_c_utils/emu_c_utils.h>
+
+#include "replicated.h"
+#include "intrinsics.h"
+#include "out_of_memory.h"
+#include "pointer_manipulation.h"
+#include "execution_policy.h"
+#include "for_each.h"
+#include "reduce.h"
+
+namespace emu {
+
+/**
+ * Growable striped array that supports concurrent push_back.
+ *
+ * Storage is a list of striped segments (each one a @c mw_malloc1dlong
+ * allocation). Segment 0 holds first_capacity elements, and each segment after
+ * that doubles the capacity, so growing never moves existing elements and
+ * references stay valid. first_capacity is a multiple of nodelets(), so
+ * element i is always on nodelet (i % nodelets()), just like a striped_array.
+ *
+ * The table of segment pointers is replicated, so finding an element never
+ * migrates. push_back claims an index with a remote atomic_addms on a single
+ * size counter on nodelet 0; the thread that claims the first index of a new
+ * segment allocates it, and any other threads that land in the segment wait
+ * for it to be published.
+ *
+ * @tparam T Element type. Must be a 64-bit type.
+ */
+template<class T>
+class striped_vector
+{
+    static_assert(sizeof(T) == 8, "striped_vector can only hold 64-bit data types");
+public:
+    // Enough segments to address 2^47 * first_capacity elements
+    static constexpr long max_segments = 48;
+
+private:
+    repl<long> first_capacity_;
+    // Replicated table of segment pointers (view-0 address)
+    repl<T**> segments_;
+    // Number of elements, stored once on nodelet 0 (absolute address)
+    repl<long*> size_;
+
+    static T**
+    allocate_table()
+    {
+        auto table = reinterpret_cast<T**>(
+            mw_mallocrepl(sizeof(T*) * max_segments));
+        if (!table) { EMU_OUT_OF_MEMORY(sizeof(T*) * max_segments * nodelets()); }
+        for (long nlet = 0; nlet < nodelets(); ++nlet) {
+            T** copy = pmanip::get_nth(table, nlet);
+            std::fill(copy, copy + max_segments, nullptr);
+        }
+        return table;
+    }
+
+    static long*
+    allocate_size()
+    {
+        auto size = reinterpret_cast<long*>(mw_malloc1dlong(1));
+        if (!size) { EMU_OUT_OF_MEMORY(sizeof(long)); }
+        *size = 0;
+        return size;
+    }
+
+    // Allocates segment k and publishes it to every copy of the table
+    void
+    allocate_segment(long k)
+    {
+        long n = segment_capacity(k);
+        auto ptr = reinterpret_cast<T*>(mw_malloc1dlong(n));
+        if (!ptr) { EMU_OUT_OF_MEMORY(n * sizeof(long)); }
+        for (long nlet = 0; nlet < nodelets(); ++nlet) {
+            pmanip::get_nth(static_cast<T**>(segments_), nlet)[k] = ptr;
+        }
+    }
+
+    // Returns segment k, waiting for another thread to allocate it if needed
+    T*
+    wait_for_segment(long k)
+    {
+        // The table slot is volatile, so each iteration reloads it
+        T* volatile const* table = segments_;
+        T* ptr;
+        while (!(ptr = table[k])) { RESCHEDULE(); }
+        return ptr;
+    }
+
+    // Claims n consecutive indices and makes sure their segments exist
+    long
+    claim(long n)
+    {
+        long first = atomic_addms(static_cast<long*>(size_), n);
+        // Allocate each new segment that starts within the claimed range
+        for (long k = segment_of(first); k <= segment_of(first + n - 1); ++k) {
+            if (segment_begin(k) >= first && !segments_[k]) {
+                allocate_segment(k);
+            }
+        }
+        return first;
+    }
+
+    // Destroys the elements in [first, last)
+    void
+    destroy(long first, long last)
+    {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for_each_segment(first, last, [](T* begin, T* end) {
+                parallel::for_each(fixed, begin, end, [](T& x) { x.~T(); });
+            });
+        }
+    }
+
+public:
+    typedef T value_type;
+
+    // Default constructor
+    striped_vector() : first_capacity_(0), segments_(nullptr), size_(nullptr) {}
+
+    /**
+     * Constructs an empty striped_vector
+     * @param first_capacity Capacity of the first segment, rounded up to a
+     * multiple of nodelets()
+     */
+    explicit striped_vector(long first_capacity)
+    : first_capacity_(std::max(1L,
+        (first_capacity + nodelets() - 1) / nodelets()) * nodelets())
+    , segments_(allocate_table())
+    , size_(allocate_size())
+    {}
+
+    ~striped_vector()
+    {
+        if (!segments_) { return; }
+        destroy(0, size());
+        for (long k = 0; k < max_segments && segments_[k]; ++k) {
+            mw_free(segments_[k]);
+        }
+        mw_free(segments_);
+        mw_free(size_);
+    }
+
+    friend void
+    swap(striped_vector& first, striped_vector& second)
+    {
+        using std::swap;
+        swap(first.first_capacity_, second.first_capacity_);
+        swap(first.segments_, second.segments_);
+        swap(first.size_, second.size_);
+    }
+
+    // Copy constructor
+    striped_vector(const striped_vector & other) = delete;
+
+    // Assignment operator (using copy-and-swap idiom)
+    striped_vector& operator= (striped_vector other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+
+    // Move constructor (using copy-and-swap idiom)
+    striped_vector(striped_vector&& other) noexcept : striped_vector()
+    {
+        swap(*this, other);
+    }
+
+    // Shallow copy constructor (used for repl<T>)
+    striped_vector(const striped_vector& other, shallow_copy)
+    : first_capacity_(other.first_capacity_)
+    , segments_(other.segments_)
+    , size_(other.size_)
+    {}
+
+    // Returns the segment that holds element i
+    long
+    segment_of(long i) const
+    {
+        long q = i / first_capacity_;
+        if (q == 0) { return 0; }
+        // Segment k >= 1 starts at first_capacity * 2^(k-1)
+        return 64 - __builtin_clzl(static_cast<unsigned long>(q));
+    }
+
+    // Index of the first element in segment k
+    long
+    segment_begin(long k) const
+    {
+        long n = first_capacity_;
+        return k == 0 ? 0 : n << (k - 1);
+    }
+
+    // Number of elements that fit in segment k
+    long
+    segment_capacity(long k) const
+    {
+        long n = first_capacity_;
+        return k == 0 ? n : n << (k - 1);
+    }
+
+    // Returns a pointer to the first element of segment k, or nullptr if it
+    // has not been allocated
+    T* segment(long k) { return segments_[k]; }
+    const T* segment(long k) const { return segments_[k]; }
+
+    /**
+     * Calls f(begin, end) with a pair of striped pointers for each segment (or
+     * partial segment) of the elements in [first, last), in order
+     */
+    template<class Function>
+    void
+    for_each_segment(long first, long last, Function f) const
+    {
+        for (long k = segment_of(first); first < last; ++k) {
+            long end = std::min(last, segment_begin(k) + segment_capacity(k));
+            T* ptr = segments_[k];
+            f(ptr + (first - segment_begin(k)), ptr + (end - segment_begin(k)));
+            first = end;
+        }
+    }
+
+    /**
+     * Returns the number of elements. While push_back is running, this
+     * includes elements that have been claimed but not yet written.
+     */
+    long size() const { return *size_; }
+    bool empty() const { return size() == 0; }
+
+    // Number of elements that fit in the allocated segments
+    long capacity() const
+    {
+        long k = 0;
+        while (k < max_segments && segments_[k]) { ++k; }
+        return k == 0 ? 0 : segment_begin(k - 1) + segment_capacity(k - 1);
+    }
+
+    /**
+     * Allocates segments until at least n elements fit. Must not be called
+     * concurrently with push_back.
+     */
+    void reserve(long n)
+    {
+        for (long k = 0; capacity() < n; ++k) {
+            if (!segments_[k]) { allocate_segment(k); }
+        }
+    }
+
+    T& operator[] (long i)
+    {
+        long k = segment_of(i);
+        return segments_[k][i - segment_begin(k)];
+    }
+    const T& operator[] (long i) const
+    {
+        long k = segment_of(i);
+        return segments_[k][i - segment_begin(k)];
+    }
+
+    /**
+     * Constructs an element in place at the end of the vector. Safe to call
+     * from many threads at once; elements are stored in the order the threads
+     * claim their indices.
+     * @return The index of the new element
+     */
+    template<class... Args>
+    long emplace_back(Args&&... args)
+    {
+        long i = claim(1);
+        long k = segment_of(i);
+        T* ptr = wait_for_segment(k) + (i - segment_begin(k));
+        new (ptr) T(std::forward<Args>(args)...);
+        return i;
+    }
+
+    long push_back(const T& value) { return emplace_back(value); }
+    long push_back(T&& value) { return emplace_back(std::move(value)); }
+
+    /**
+     * Destroys all elements. The segments are kept for reuse. Must not be
+     * called concurrently with push_back.
+     */
+    void clear()
+    {
+        destroy(0, size());
+        *size_ = 0;
+    }
+};
+
+} // end namespace emu
+
+namespace emu::parallel {
+
+/**
+ * for_each over a striped_vector. Each segment is a striped array, so this
+ * forwards to the striped for_each for each segment in turn.
+ */
+template<class ExecutionPolicy, class T, class UnaryFunction,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+void
+for_each(ExecutionPolicy policy, striped_vector<T>& vec, UnaryFunction worker)
+{
+    vec.for_each_segment(0, vec.size(), [&](T* begin, T* end) {
+        for_each(policy, begin, end, worker);
+    });
+}
+
+/**
+ * reduce over a striped_vector. Each segment is reduced in turn with the
+ * striped reduce, starting from the result of the segments before it, so init
+ * is folded in exactly once.
+ */
+template<class ExecutionPolicy, class T, class U = T,
+    class BinaryOp = std::plus<>,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<ExecutionPolicy>, int> = 0
+>
+U
+reduce(ExecutionPolicy policy, const striped_vector<T>& vec,
+    U init = U{}, BinaryOp binary_op = std::plus<>())
+{
+    U result = init;
+    vec.for_each_segment(0, vec.size(), [&](T* begin, T* end) {
+        result = reduce(policy, begin, end, result, binary_op);
+    });
+    return result;
+}
+
+template<class T, class UnaryFunction>
+void
+for_each(striped_vector<T>& vec, UnaryFunction worker)
+{
+    for_each(emu::default_policy, vec, worker);
+}
+
+template<class T, class U = T, class BinaryOp = std::plus<>>
+U
+reduce(const striped_vector<T>& vec,
+    U init = U{}, BinaryOp binary_op = std::plus<>())
+{
+    return reduce(emu::default_policy, vec, init, binary_op);
+}
+
+} // end namespace emu::parallel
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <emu_c_utils/emu_c_utils.h>
+#include "pointer_manipulation.h"
+#include "execution_policy.h"
+#include "intrinsics.h"
+
+/*
+ * Tracks the number of active worker threads on each nodelet, so that nested
+ * parallel calls (i.e. a for_each inside a for_each) can run serially when a
+ * nodelet is already saturated, rather than spawning past MAXDEPTH() or
+ * running out of thread slots.
+ *
+ * Each worker thread spawned by the parallel algorithms holds a
+ * thread_budget_guard while it runs. The algorithms check
+ * thread_budget_exhausted() before spawning, and fall back to the serial
+ * version of the policy (remove_parallel_t) if the local count has reached
+ * runtime_config::thread_budget.
+ */
+
+namespace emu {
+namespace detail {
+// Number of active worker threads, one counter per nodelet
+inline replicated long the_active_threads;
+} // end namespace detail
+
+/**
+ * Counts the current thread against the thread budget of the nodelet where it
+ * was created. The count is decremented on the same nodelet, even if the
+ * thread migrates in between.
+ */
+class thread_budget_guard
+{
+private:
+    // Absolute (view-1) pointer to the counter where this thread started
+    volatile long * counter_;
+public:
+    thread_budget_guard()
+    : counter_(pmanip::get_nth(&detail::the_active_threads, NODE_ID()))
+    {
+        remote_add(counter_, 1);
+    }
+
+    ~thread_budget_guard()
+    {
+        remote_add(counter_, -1);
+    }
+
+    thread_budget_guard(const thread_budget_guard&) = delete;
+    thread_budget_guard& operator=(const thread_budget_guard&) = delete;
+};
+
+// Returns the number of active worker threads on the local nodelet
+inline long
+active_threads()
+{
+    return detail::the_active_threads;
+}
+
+/**
+ * Returns true if a parallel algorithm called with this policy should run
+ * serially, because the local nodelet has no thread budget left.
+ * Always false for serial policies.
+ */
+template<class Policy>
+inline bool
+thread_budget_exhausted(Policy)
+{
+    if constexpr (std::is_same_v<remove_parallel_t<Policy>, Policy>) {
+        return false;
+    } else {
+        return active_threads() >= get_runtime_config().thread_budget;
+    }
+}
+
+} // end namespace emu
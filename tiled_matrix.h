@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <type_traits>
+#include <cilk/cilk.h>
+#include <emu_c_utils/emu_c_utils.h>
+#include "execution_policy.h"
+#include "out_of_memory.h"
+#include "thread_budget.h"
+#include "block_array.h"
+
+namespace emu {
+
+/**
+ * Distributed dense matrix, divided into square tiles. Each tile is stored
+ * contiguously in row-major order, and the tiles (numbered in row-major
+ * order) are dealt out to the nodelets round-robin. Tiles on the right and
+ * bottom edges are padded to the full tile size.
+ *
+ * Storage is a block_array with one tile per block. Elements are left
+ * uninitialized.
+ *
+ * @tparam T Element type
+ */
+template<class T>
+class tiled_matrix
+{
+    static_assert(std::is_trivially_copyable_v<T>,
+        "Tiles are copied with std::copy into local scratch buffers");
+private:
+    repl<long> rows_;
+    repl<long> cols_;
+    repl<long> tile_;
+    repl<long> tile_cols_;
+    block_array<T> tiles_;
+
+    static long
+    div_up(long n, long d) { return (n + d - 1) / d; }
+
+public:
+    typedef T value_type;
+
+    // Default constructor
+    tiled_matrix() : rows_(0), cols_(0), tile_(0), tile_cols_(0) {}
+
+    /**
+     * Constructs a rows x cols matrix
+     * @param tile Number of rows and columns in each tile
+     */
+    tiled_matrix(long rows, long cols, long tile = 32)
+    : rows_(rows)
+    , cols_(cols)
+    , tile_(tile)
+    , tile_cols_(div_up(cols, tile))
+    , tiles_(div_up(rows, tile) * div_up(cols, tile) * tile * tile,
+        tile * tile)
+    {}
+
+    // Move constructor
+    tiled_matrix(tiled_matrix&& other) noexcept : tiled_matrix()
+    {
+        swap(*this, other);
+    }
+
+    // Assignment operator (using copy-and-swap idiom)
+    tiled_matrix& operator= (tiled_matrix other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+
+    friend void
+    swap(tiled_matrix& first, tiled_matrix& second)
+    {
+        using std::swap;
+        swap(first.rows_, second.rows_);
+        swap(first.cols_, second.cols_);
+        swap(first.tile_, second.tile_);
+        swap(first.tile_cols_, second.tile_cols_);
+        swap(first.tiles_, second.tiles_);
+    }
+
+    long rows() const { return rows_; }
+    long cols() const { return cols_; }
+    // Number of rows and columns in each tile
+    long tile_size() const { return tile_; }
+    // Number of tiles in each column and row of the matrix
+    long tile_rows() const { return div_up(rows_, tile_); }
+    long tile_cols() const { return tile_cols_; }
+    long num_tiles() const { return tile_rows() * tile_cols(); }
+
+    // Number of valid rows/columns in tile row ti/tile column tj
+    long tile_height(long ti) const
+    {
+        return std::min<long>(tile_, rows_ - ti * tile_);
+    }
+    long tile_width(long tj) const
+    {
+        return std::min<long>(tile_, cols_ - tj * tile_);
+    }
+
+    // Returns the index of tile (ti, tj)
+    long tile_index(long ti, long tj) const { return ti * tile_cols_ + tj; }
+
+    // Returns the nodelet that holds tile (ti, tj)
+    long tile_nodelet(long ti, long tj) const
+    {
+        return tiles_.block_nodelet(tile_index(ti, tj));
+    }
+
+    // Returns a pointer to the first element of tile (ti, tj)
+    T* tile(long ti, long tj) { return tiles_.block(tile_index(ti, tj)); }
+    const T* tile(long ti, long tj) const
+    {
+        return const_cast<block_array<T>&>(tiles_).block(tile_index(ti, tj));
+    }
+
+    // Underlying storage, one block per tile
+    block_array<T>& storage() { return tiles_; }
+    const block_array<T>& storage() const { return tiles_; }
+
+    T& operator() (long i, long j)
+    {
+        return tile(i / tile_, j / tile_)[(i % tile_) * tile_ + j % tile_];
+    }
+    const T& operator() (long i, long j) const
+    {
+        return tile(i / tile_, j / tile_)[(i % tile_) * tile_ + j % tile_];
+    }
+};
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+// Allocates a tile-sized scratch buffer on the same nodelet as ptr
+template<class T>
+T*
+alloc_tile_scratch(long elements, void* ptr)
+{
+    auto scratch = reinterpret_cast<T*>(
+        mw_localmalloc(sizeof(T) * elements, ptr));
+    if (!scratch) { EMU_OUT_OF_MEMORY(sizeof(T) * elements); }
+    return scratch;
+}
+
+/**
+ * Computes output tile (ti, tj) of C = A * B on the nodelet that holds it.
+ * Copies each pair of input tiles A(ti, kt) and B(kt, tj) into local scratch,
+ * then accumulates their product into the output tile.
+ */
+template<class T>
+void
+gemm_tile(const tiled_matrix<T>& A, const tiled_matrix<T>& B,
+    tiled_matrix<T>& C, long ti, long tj)
+{
+    long tile = C.tile_size();
+    long height = C.tile_height(ti);
+    long width = C.tile_width(tj);
+    T* c = C.tile(ti, tj);
+    T* a = alloc_tile_scratch<T>(2 * tile * tile, c);
+    T* b = a + tile * tile;
+    for (long i = 0; i < height; ++i) {
+        std::fill(c + i * tile, c + i * tile + width, T{});
+    }
+    for (long kt = 0; kt < A.tile_cols(); ++kt) {
+        // Bulk copy of the input tiles
+        const T* a_src = A.tile(ti, kt);
+        const T* b_src = B.tile(kt, tj);
+        std::copy(a_src, a_src + tile * tile, a);
+        std::copy(b_src, b_src + tile * tile, b);
+        long depth = A.tile_width(kt);
+        for (long i = 0; i < height; ++i) {
+            for (long k = 0; k < depth; ++k) {
+                T a_ik = a[i * tile + k];
+                for (long j = 0; j < width; ++j) {
+                    c[i * tile + j] += a_ik * b[k * tile + j];
+                }
+            }
+        }
+    }
+    mw_localfree(a);
+}
+
+/**
+ * Computes block ti of y = A * x on the nodelet that holds it.
+ * Copies each tile A(ti, kt) and block kt of x into local scratch.
+ */
+template<class T>
+void
+gemv_tile(const tiled_matrix<T>& A, block_array<T>& x, block_array<T>& y,
+    long ti)
+{
+    long tile = A.tile_size();
+    long height = A.tile_height(ti);
+    T* y_local = y.block(ti);
+    T* a = alloc_tile_scratch<T>(tile * tile + tile, y_local);
+    T* x_local = a + tile * tile;
+    std::fill(y_local, y_local + height, T{});
+    for (long kt = 0; kt < A.tile_cols(); ++kt) {
+        const T* a_src = A.tile(ti, kt);
+        const T* x_src = x.block(kt);
+        std::copy(a_src, a_src + tile * tile, a);
+        std::copy(x_src, x_src + tile, x_local);
+        long depth = A.tile_width(kt);
+        for (long i = 0; i < height; ++i) {
+            T sum = y_local[i];
+            for (long k = 0; k < depth; ++k) {
+                sum += a[i * tile + k] * x_local[k];
+            }
+            y_local[i] = sum;
+        }
+    }
+    mw_localfree(a);
+}
+
+} // end namespace detail
+
+/**
+ * Blocked matrix multiply, C = A * B.
+ *
+ * Spawns one task per output tile on the tile's nodelet. Each task copies
+ * only the row of A tiles and the column of B tiles that it needs into local
+ * scratch, one pair at a time.
+ *
+ * All three matrices must have the same tile size. C must not be the same
+ * matrix as A or B, since tasks overwrite their tile of C while other tasks
+ * are still reading A and B.
+ */
+template<class Policy, class T,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<Policy>, int> = 0
+>
+void
+gemm(Policy policy,
+    const tiled_matrix<T>& A, const tiled_matrix<T>& B, tiled_matrix<T>& C)
+{
+    assert(A.cols() == B.rows());
+    assert(C.rows() == A.rows() && C.cols() == B.cols());
+    assert(A.tile_size() == C.tile_size() && B.tile_size() == C.tile_size());
+    assert(&C != &A && &C != &B);
+    const tiled_matrix<T>* a = &A;
+    const tiled_matrix<T>* b = &B;
+    tiled_matrix<T>* c = &C;
+    long tile_cols = C.tile_cols();
+    detail::for_each_block(policy, C.storage(), C.num_tiles(), [=](long t) {
+        detail::gemm_tile(*a, *b, *c, t / tile_cols, t % tile_cols);
+    });
+}
+
+/**
+ * Blocked matrix-vector multiply, y = A * x.
+ *
+ * x and y are block_arrays with one block per tile row/column of A (block
+ * size equal to A.tile_size()). Spawns one task per block of y on its
+ * nodelet.
+ */
+template<class Policy, class T,
+    // Disable if first argument is not an execution policy
+    std::enable_if_t<is_execution_policy_v<Policy>, int> = 0
+>
+void
+gemv(Policy policy,
+    const tiled_matrix<T>& A, block_array<T>& x, block_array<T>& y)
+{
+    assert(x.size() == A.cols() && y.size() == A.rows());
+    assert(x.block_size() == A.tile_size() && y.block_size() == A.tile_size());
+    const tiled_matrix<T>* a = &A;
+    block_array<T>* x_ptr = &x;
+    block_array<T>* y_ptr = &y;
+    detail::for_each_block(policy, y, y.num_blocks(), [=](long ti) {
+        detail::gemv_tile(*a, *x_ptr, *y_ptr, ti);
+    });
+}
+
+// Default policy: pick the schedule from the runtime configuration
+template<class T>
+void
+gemm(const tiled_matrix<T>& A, const tiled_matrix<T>& B, tiled_matrix<T>& C)
+{
+    gemm(emu::default_policy, A, B, C);
+}
+
+template<class T>
+void
+gemv(const tiled_matrix<T>& A, block_array<T>& x, block_array<T>& y)
+{
+    gemv(emu::default_policy, A, x, y);
+}
+
+} // end namespace emu::parallel
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <cilk/cilk.h>
+#include "execution_policy.h"
+#include "nlet_stride_iterator.h"
+#include "out_of_memory.h"
+#include "for_each.h"
+#include "stripe_layout.h"
+
+namespace emu {
+
+/**
+ * Wraps a prefix sum of per-element costs, such as the offsets array of a
+ * CSR graph. offsets[i+1] - offsets[i] is the cost of element i, so there
+ * must be one more offset than there are elements.
+ */
+template<class Iterator>
+struct cost_prefix_sum
+{
+    Iterator offsets;
+};
+
+template<class Iterator>
+cost_prefix_sum<Iterator>
+prefix_costs(Iterator offsets)
+{
+    return cost_prefix_sum<Iterator>{offsets};
+}
+
+} // end namespace emu
+
+namespace emu::parallel {
+namespace detail {
+
+// Cost of the i'th element, using a cost function
+template<class Iterator, class CostFunction>
+long
+element_cost(CostFunction& cost, Iterator begin, long i)
+{
+    return cost(begin[i]);
+}
+
+// Cost of the i'th element, using a prefix sum of costs
+template<class Iterator, class OffsetIterator>
+long
+element_cost(cost_prefix_sum<OffsetIterator>& cost, Iterator begin, long i)
+{
+    return cost.offsets[i + 1] - cost.offsets[i];
+}
+
+/**
+ * Splits [begin, end) into grains of roughly equal cost and spawns a thread
+ * for each one. Cut points are found by binary search over the prefix sum.
+ *
+ * @param prefix prefix[j] is the total cost of the elements before begin + j,
+ * there are (end - begin + 1) entries
+ */
+template<class Policy, class Iterator, class PrefixIterator,
+    class UnaryFunction>
+void
+weighted_spawn(
+    Policy policy,
+    Iterator begin, Iterator end,
+    PrefixIterator prefix,
+    UnaryFunction worker
+) {
+    long n = end - begin;
+    // Spawn one grain per thread, unless there are too few elements
+    long num_grains = n / get_grain(policy);
+    long max_threads = get_threads_per_nodelet(policy);
+    if (num_grains > max_threads) { num_grains = max_threads; }
+    if (num_grains < 1) { num_grains = 1; }
+
+    long base = prefix[0];
+    long total = prefix[n] - base;
+    long first = 0;
+    for (long g = 1; g <= num_grains; ++g) {
+        long last = n;
+        if (g < num_grains) {
+            // Find the first element where the running cost reaches the
+            // target for this grain
+            long target = base + (total / num_grains) * g
+                + (total % num_grains) * g / num_grains;
+            last = std::lower_bound(prefix + first, prefix + n, target)
+                - prefix;
+        }
+        // A single expensive element may span several grains
+        if (last > first) {
+            cilk_spawn_at(ptr_from_iter(begin + first)) detail::for_each_grain(
+                policy, begin + first, begin + last, worker);
+        }
+        first = last;
+    }
+}
+
+/**
+ * Weighted schedule for a range that is all on one nodelet. Builds the prefix
+ * sum of costs in local scratch memory, then splits it into grains.
+ */
+template<class Policy, class Iterator, class Cost, class UnaryFunction>
+void
+weighted_for_each(
+    Policy policy,
+    Iterator begin, Iterator end,
+    Cost cost, UnaryFunction worker
+) {
+    long n = end - begin;
+    auto prefix = reinterpret_cast<long*>(
+        mw_localmalloc(sizeof(long) * (n + 1), ptr_from_iter(begin)));
+    if (!prefix) { EMU_OUT_OF_MEMORY(sizeof(long) * (n + 1)); }
+    prefix[0] = 0;
+    for (long i = 0; i < n; ++i) {
+        prefix[i + 1] = prefix[i] + element_cost(cost, begin, i);
+    }
+    weighted_spawn(policy, begin, end, prefix, worker);
+    // Scratch must stay valid until all the grains are done
+    cilk_sync;
+    mw_localfree(prefix);
+}
+
+// A local range with a prefix sum of costs can be split without scratch space
+template<class Policy, class Iterator, class OffsetIterator,
+    class UnaryFunction>
+void
+weighted_for_each(
+    Policy policy,
+    Iterator begin, Iterator end,
+    cost_prefix_sum<OffsetIterator> cost, UnaryFunction worker
+) {
+    weighted_spawn(policy, begin, end, cost.offsets, worker);
+}
+
+/**
+ * Fills prefix[0..n] with the prefix sum of costs of the n elements of the
+ * stripe on nlet. The j'th element of the stripe is at global index
+ * nlet + j * NODELETS().
+ */
+template<class Iterator, class CostFunction>
+void
+stripe_prefix_costs(CostFunction& cost, Iterator begin, long nlet, long n,
+    long* prefix)
+{
+    prefix[0] = 0;
+    for (long j = 0; j < n; ++j) {
+        prefix[j + 1] = prefix[j] + cost(begin[nlet + nlet_mul(j)]);
+    }
+}
+
+/**
+ * With a prefix sum of costs, offsets[i + 1] is on the next nodelet. Gather
+ * all of them into the scratch array in one pass first, so the thread
+ * migrates there and back once instead of once per element. Then turn them
+ * into a running sum of costs next to the stripe.
+ */
+template<class Iterator, class OffsetIterator>
+void
+stripe_prefix_costs(cost_prefix_sum<OffsetIterator>& cost, Iterator begin,
+    long nlet, long n, long* prefix)
+{
+    for (long j = 0; j < n; ++j) {
+        prefix[j + 1] = cost.offsets[nlet + nlet_mul(j) + 1];
+    }
+    prefix[0] = 0;
+    for (long j = 0; j < n; ++j) {
+        long next = prefix[j + 1];
+        prefix[j + 1] = prefix[j] + (next - cost.offsets[nlet + nlet_mul(j)]);
+    }
+}
+
+// Builds the prefix sum over the stripe on one nodelet, then splits it
+template<class Policy, class Iterator, class Cost, class UnaryFunction>
+void
+weighted_for_each_stripe(
+    Policy policy, long nlet,
+    nlet_stride_iterator<Iterator> stripe_begin,
+    nlet_stride_iterator<Iterator> stripe_end,
+    Iterator begin, Cost cost, UnaryFunction worker
+) {
+    long n = stripe_end - stripe_begin;
+    auto prefix = reinterpret_cast<long*>(mw_localmalloc(
+        sizeof(long) * (n + 1), ptr_from_iter(stripe_begin)));
+    if (!prefix) { EMU_OUT_OF_MEMORY(sizeof(long) * (n + 1)); }
+    stripe_prefix_costs(cost, begin, nlet, n, prefix);
+    weighted_spawn(policy, stripe_begin, stripe_end, prefix, worker);
+    // Scratch must stay valid until all the grains are done
+    cilk_sync;
+    mw_localfree(prefix);
+}
+
+// Weighted schedule for striped layouts
+// Each nodelet builds the prefix sum over its own stripe
+template<class Policy, class Iterator, class Cost, class UnaryFunction>
+void
+striped_weighted_for_each(
+    Policy policy,
+    long nlet_begin, long nlet_end,
+    Iterator begin, Iterator end,
+    Cost cost, UnaryFunction worker
+) {
+    // Recursive spawn
+    // Stop splitting once we are down to spawn_radix nodelets
+    const long nlet_radix = get_spawn_radix(policy);
+    for(;;) {
+        // How many nodelets do we need to spawn on?
+        auto nlet_count = nlet_end - nlet_begin;
+        if (nlet_count <= nlet_radix) { break; }
+        // Divide the nodelets in half
+        long nlet_mid = nlet_begin + nlet_count / 2;
+        // Spawn a thread to handle the upper half
+        cilk_migrate_hint(ptr_from_iter(begin + nlet_mid));
+        cilk_spawn striped_weighted_for_each(
+            policy, nlet_mid, nlet_end, begin, end, cost, worker);
+        // Recurse over the lower half
+        nlet_end = nlet_mid;
+    }
+
+    // Number of elements on each nodelet
+    stripe_layout layout(end - begin);
+    // For each nodelet in my subrange...
+    for (long nlet = nlet_begin; nlet < nlet_end; ++nlet) {
+        auto stripe_begin = nlet_stride_iterator<Iterator>(begin + nlet);
+        auto stripe_end = stripe_begin + layout.count(nlet);
+        if (stripe_begin == stripe_end) { continue; }
+        // Spawn a thread to handle each stripe
+        cilk_migrate_hint(ptr_from_iter(stripe_begin));
+        cilk_spawn weighted_for_each_stripe(policy, nlet,
+            stripe_begin, stripe_end, begin, cost, worker);
+    }
+}
+
+} // end namespace detail
+
+// Serial policies don't need a schedule, ignore the costs
+template<class Iterator, class Cost, class UnaryFunction>
+void
+weighted_for_each(
+   sequenced_policy policy,
+   Iterator begin, Iterator end,
+   Cost cost, UnaryFunction worker
+){
+   for_each(policy, begin, end, worker);
+}
+
+template<class Iterator, class Cost, class UnaryFunction>
+void
+weighted_for_each(
+   unroll_policy policy,
+   Iterator begin, Iterator end,
+   Cost cost, UnaryFunction worker
+){
+   for_each(policy, begin, end, worker);
+}
+
+/**
+ * Applies worker to each element in [begin, end), using a static schedule
+ * where each thread is given the same total cost rather than the same number
+ * of elements. Useful when the cost of an element varies widely, i.e.
+ * iterating over the vertices of a graph where the cost is the degree.
+ *
+ * @param cost Either a function that returns the cost (a long) of an element,
+ * or emu::prefix_costs(offsets) with the prefix sum of costs. The prefix sum
+ * avoids a scan over the range for local data, but with striped data every
+ * nodelet still scans its own stripe. The offsets must be laid out like the
+ * range (both local, or both striped from the same nodelet).
+ */
+template<class Policy, class Iterator, class Cost, class UnaryFunction,
+   std::enable_if_t<is_static_policy_v<Policy>, int> = 0
+>
+void
+weighted_for_each(
+   Policy policy,
+   Iterator begin, Iterator end,
+   Cost cost, UnaryFunction worker
+){
+   if (end-begin == 0) {
+       return;
+   } else if (thread_budget_exhausted(policy)) {
+       // Nodelet is saturated, run serially instead
+       weighted_for_each(remove_parallel_t<Policy>(),
+           begin, end, cost, worker);
+   } else if (is_striped(begin)) {
+       detail::striped_weighted_for_each(
+           policy, 0, nodelets(), begin, end, cost, worker);
+   } else {
+       detail::weighted_for_each(policy, begin, end, cost, worker);
+   }
+}
+
+template<class Iterator, class Cost, class UnaryFunction>
+void
+weighted_for_each(Iterator begin, Iterator end, Cost cost,
+   UnaryFunction worker
+){
+   weighted_for_each(static_policy<runtime_grain>(),
+       begin, end, cost, worker);
+}
+
+} // end namespace emu::parallel